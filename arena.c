@@ -0,0 +1,94 @@
+// MAP_ANONYMOUS is not part of POSIX.1-2008
+#define _DEFAULT_SOURCE
+
+#include "arena.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ARENA_ALIGNMENT 16
+
+/// Start of the shared mapping. Allocations are carved from it by bumping
+/// `used`, which lives at its start so every process shares it.
+struct SharedArena {
+  atomic_size_t used;
+  size_t size;
+};
+
+static struct SharedArena* shared_arena = NULL;
+
+static size_t align_up(size_t size) { return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1); }
+
+int arena_init_shared(size_t size) {
+  if (shared_arena != NULL) {
+    fprintf(stderr, "Shared memory has already been set up\n");
+    return 1;
+  }
+
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  shared_arena = mapping;
+  atomic_init(&shared_arena->used, align_up(sizeof(struct SharedArena)));
+  shared_arena->size = size;
+  return 0;
+}
+
+int arena_is_shared() { return shared_arena != NULL; }
+
+void* arena_alloc(size_t size) {
+  if (shared_arena == NULL) {
+    return malloc(size);
+  }
+
+  size = align_up(size);
+  size_t offset = atomic_fetch_add(&shared_arena->used, size);
+  if (offset > shared_arena->size || size > shared_arena->size - offset) {
+    fprintf(stderr, "Shared memory exhausted\n");
+    return NULL;
+  }
+  return (char*)shared_arena + offset;
+}
+
+void* arena_calloc(size_t count, size_t size) {
+  if (shared_arena == NULL) {
+    return calloc(count, size);
+  }
+
+  if (size != 0 && count > (size_t)-1 / size) return NULL;
+  // The mapping starts zeroed and memory is never handed out twice
+  return arena_alloc(count * size);
+}
+
+void arena_free(void* ptr) {
+  if (shared_arena == NULL) {
+    free(ptr);
+  }
+}
+
+int arena_mutex_init(pthread_mutex_t* mutex) {
+  pthread_mutexattr_t attr;
+  if (pthread_mutexattr_init(&attr) != 0) return 1;
+
+  if (shared_arena != NULL && pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0) {
+    pthread_mutexattr_destroy(&attr);
+    return 1;
+  }
+
+  int result = pthread_mutex_init(mutex, &attr) != 0;
+  pthread_mutexattr_destroy(&attr);
+  return result;
+}
+
+void arena_destroy() {
+  if (shared_arena == NULL) return;
+
+  munmap(shared_arena, shared_arena->size);
+  shared_arena = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef EMS_ARENA_H
+#define EMS_ARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/// Makes the EMS state allocations come from a single MAP_SHARED mapping,
+/// so processes forked afterwards all see and update the same state at the
+/// same addresses. Without it, allocations go through malloc.
+/// @note Must be called before anything is allocated.
+/// @param size Size of the mapping in bytes. Pages are only backed by memory
+/// once touched.
+/// @return 0 if the mapping was created successfully, 1 otherwise.
+int arena_init_shared(size_t size);
+
+/// Tells whether allocations come from the shared mapping.
+/// @return 1 if they do, 0 otherwise.
+int arena_is_shared();
+
+/// Allocates state memory, aligned for any type.
+/// @param size Number of bytes.
+/// @return Pointer to the memory, NULL on failure.
+void* arena_alloc(size_t size);
+
+/// Allocates zeroed state memory for an array.
+/// @param count Number of elements.
+/// @param size Size of each element.
+/// @return Pointer to the memory, NULL on failure.
+void* arena_calloc(size_t count, size_t size);
+
+/// Frees state memory.
+/// @note Shared memory is only given back by arena_destroy.
+/// @param ptr Pointer returned by arena_alloc or arena_calloc, or NULL.
+void arena_free(void* ptr);
+
+/// Initializes a mutex that guards state memory. In shared mode the mutex
+/// works across processes.
+/// @param mutex Mutex to be initialized.
+/// @return 0 if the mutex was initialized successfully, 1 otherwise.
+int arena_mutex_init(pthread_mutex_t* mutex);
+
+/// Unmaps the shared mapping, if any.
+void arena_destroy();
+
+#endif  // EMS_ARENA_H
@@ -0,0 +1,119 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Generates a synthetic .jobs workload on stdout. Every event is created up
+// front, followed by a BARRIER, so that the timed commands never race with
+// the CREATEs whatever the number of threads.
+
+#define USAGE \
+  "Usage: gen [-e events] [-r rows] [-c cols] [-n commands] [-b batch] [-s show%%] [-l list%%]\n" \
+  "           [-B barrier_every] [-k hot%%] [-x seed]\n" \
+  "  -e  number of events (4)\n" \
+  "  -r  rows of each event (10)\n" \
+  "  -c  columns of each event (10)\n" \
+  "  -n  number of commands after the CREATEs (10000)\n" \
+  "  -b  seats per RESERVE (2)\n" \
+  "  -s  percentage of SHOW commands (10)\n" \
+  "  -l  percentage of LIST commands (1)\n" \
+  "  -B  a BARRIER every this many commands, 0 for none (0)\n" \
+  "  -k  percentage of commands aimed at event 1, the others are uniform (0)\n" \
+  "  -x  random seed (1)\n"
+
+#define MAX_BATCH 255
+
+static uint64_t rng_state;
+
+/// xorshift64*, so that a seed gives the same workload everywhere.
+static uint64_t next_random(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+/// @return A random number in [0, bound).
+static unsigned long random_below(unsigned long bound) {
+  return (unsigned long)(next_random() % bound);
+}
+
+static int parse_arg(const char *arg, unsigned long max, unsigned long *value) {
+  char *endptr;
+  *value = strtoul(arg, &endptr, 10);
+  return *endptr != '\0' || *value > max;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long events = 4, rows = 10, cols = 10, commands = 10000, batch = 2;
+  unsigned long show_pct = 10, list_pct = 1, barrier_every = 0, hot_pct = 0, seed = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "e:r:c:n:b:s:l:B:k:x:")) != -1) {
+    int invalid;
+    switch (opt) {
+      case 'e': invalid = parse_arg(optarg, UINT32_MAX, &events) || events == 0; break;
+      case 'r': invalid = parse_arg(optarg, UINT32_MAX, &rows) || rows == 0; break;
+      case 'c': invalid = parse_arg(optarg, UINT32_MAX, &cols) || cols == 0; break;
+      case 'n': invalid = parse_arg(optarg, ULONG_MAX, &commands); break;
+      case 'b': invalid = parse_arg(optarg, MAX_BATCH, &batch) || batch == 0; break;
+      case 's': invalid = parse_arg(optarg, 100, &show_pct); break;
+      case 'l': invalid = parse_arg(optarg, 100, &list_pct); break;
+      case 'B': invalid = parse_arg(optarg, ULONG_MAX, &barrier_every); break;
+      case 'k': invalid = parse_arg(optarg, 100, &hot_pct); break;
+      case 'x': invalid = parse_arg(optarg, ULONG_MAX, &seed); break;
+      default: invalid = 1; break;
+    }
+    if (invalid) {
+      fprintf(stderr, USAGE);
+      return 1;
+    }
+  }
+  if (show_pct + list_pct > 100 || batch > rows * cols) {
+    fprintf(stderr, "Invalid workload: SHOW and LIST over 100%% or batch larger than an event\n");
+    return 1;
+  }
+  rng_state = seed ? seed : 1;
+
+  for (unsigned long e = 1; e <= events; e++) {
+    printf("CREATE %lu %lu %lu\n", e, rows, cols);
+  }
+  printf("BARRIER\n");
+
+  unsigned long xs[MAX_BATCH], ys[MAX_BATCH];
+  for (unsigned long i = 0; i < commands; i++) {
+    if (barrier_every > 0 && i > 0 && i % barrier_every == 0) {
+      printf("BARRIER\n");
+    }
+
+    unsigned long event = random_below(100) < hot_pct ? 1 : 1 + random_below(events);
+    unsigned long kind = random_below(100);
+    if (kind < show_pct) {
+      printf("SHOW %lu\n", event);
+    } else if (kind < show_pct + list_pct) {
+      printf("LIST\n");
+    } else {
+      // distinct seats, so each reservation keeps the requested batch size
+      unsigned long n = 0;
+      while (n < batch) {
+        unsigned long x = 1 + random_below(rows), y = 1 + random_below(cols), j;
+        for (j = 0; j < n && (xs[j] != x || ys[j] != y); j++)
+          ;
+        if (j == n) {
+          xs[n] = x;
+          ys[n] = y;
+          n++;
+        }
+      }
+
+      printf("RESERVE %lu [", event);
+      for (unsigned long j = 0; j < n; j++) {
+        if (j > 0) putchar(' ');
+        printf("(%lu,%lu)", xs[j], ys[j]);
+      }
+      printf("]\n");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Runs the synthetic workloads across process, thread and delay settings and
+# prints one JSON line per run on stdout:
+#
+#   {"workload":..., "procs":..., "threads":..., "delay_ms":..., "jobs":..., "commands":...,
+#    "wall_s":..., "commands_per_sec":..., "p50_us":..., "p99_us":...}
+#
+# commands_per_sec is over the whole run. p50_us and p99_us are those of the
+# slowest job, as reported by ems -S.
+#
+# Settings come from the environment:
+#   EMS       ems binary (bench/ems)
+#   GEN       workload generator (bench/gen)
+#   PROCS     max_proc values ("1 2 4")
+#   THREADS   max_threads values ("1 2 4")
+#   DELAYS    state access delays in ms ("0")
+#   JOBS      job files per workload (4)
+#   WORKLOADS workload names, see below (all of them)
+#   EMS_FLAGS extra options for ems, e.g. "-o" or "-P"
+set -e
+
+EMS=${EMS:-bench/ems}
+GEN=${GEN:-bench/gen}
+PROCS=${PROCS:-"1 2 4"}
+THREADS=${THREADS:-"1 2 4"}
+DELAYS=${DELAYS:-"0"}
+JOBS=${JOBS:-4}
+WORKLOADS=${WORKLOADS:-"small wide batch barriers hot"}
+
+workload_args() {
+  case "$1" in
+    small)    echo "-e 4 -r 10 -c 10 -n 20000" ;;
+    wide)     echo "-e 2 -r 100 -c 100 -n 5000 -s 20" ;;
+    batch)    echo "-e 4 -r 50 -c 50 -n 10000 -b 16" ;;
+    barriers) echo "-e 4 -r 10 -c 10 -n 20000 -B 100" ;;
+    hot)      echo "-e 16 -r 20 -c 20 -n 20000 -k 90" ;;
+    *) echo "Unknown workload $1" >&2; exit 1 ;;
+  esac
+}
+
+now() {
+  date +%s.%N
+}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+for workload in $WORKLOADS; do
+  args=$(workload_args "$workload")
+  rm -f "$work"/*
+  i=1
+  while [ "$i" -le "$JOBS" ]; do
+    # shellcheck disable=SC2086
+    "$GEN" $args -x "$i" > "$work/$workload-$i.jobs"
+    i=$((i + 1))
+  done
+
+  for delay in $DELAYS; do
+    for procs in $PROCS; do
+      for threads in $THREADS; do
+        start=$(now)
+        # shellcheck disable=SC2086
+        "$EMS" $EMS_FLAGS -S "$work/stats" "$work/" "$procs" "$threads" "$delay" > /dev/null 2> /dev/null
+        end=$(now)
+
+        awk -v workload="$workload" -v procs="$procs" -v threads="$threads" -v delay="$delay" \
+            -v start="$start" -v end="$end" '
+          function field(name,   m) {
+            if (match($0, "\"" name "\":[0-9.]+")) return substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+            return 0
+          }
+          {
+            jobs++
+            commands += field("commands")
+            if (field("p50_us") + 0 > p50) p50 = field("p50_us") + 0
+            if (field("p99_us") + 0 > p99) p99 = field("p99_us") + 0
+          }
+          END {
+            wall = end - start
+            rate = wall > 0 ? commands / wall : 0
+            printf "{\"workload\":\"%s\",\"procs\":%d,\"threads\":%d,\"delay_ms\":%d,\"jobs\":%d,\"commands\":%d,", workload, procs, threads, delay, jobs, commands
+            printf "\"wall_s\":%.3f,\"commands_per_sec\":%.1f,\"p50_us\":%.2f,\"p99_us\":%.2f}\n", wall, rate, p50, p99
+          }' "$work/stats"
+      done
+    done
+  done
+done
@@ -1,11 +1,16 @@
 #define MAX_RESERVATION_SIZE 256
+#define MAX_BATCH_SIZE 1024
+#define MAX_BATCH_SEATS 4096
 #define STATE_ACCESS_DELAY_MS 10
+#define SNAPSHOT_RETRIES 64
+#define RENDER_FLUSH_BYTES (1024 * 1024)
+#define WRITER_HELD_BYTES (64 * 1024 * 1024)
+#define MAX_PARSE_THREADS 64
+#define LOCK_REPORT_TOP 5
+#define SPARSE_EVENT_SEATS (1024 * 1024)
 
 #define MSG_CREATE "create entered\n"
 #define MSG_RESERVE "reserve entered\n"
 #define MSG_SHOW "show entered\n"
 #define MSG_NO_EVENTS "No events\n"
-#define MSG_WAITING "Waiting...\n"
-
-#define BARRIER_ON 1
-#define BARRIER_OFF 0
\ No newline at end of file
+#define MSG_WAITING "Waiting...\n"
\ No newline at end of file
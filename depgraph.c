@@ -0,0 +1,141 @@
+#include "depgraph.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/// Marks the absence of an instruction.
+#define NO_INSTRUCTION SIZE_MAX
+
+/// Last instruction of the current phase that touched an event.
+struct EventLast {
+  unsigned int event_id;
+  size_t phase;        // Phase the entry was written in, 0 for an empty slot
+  size_t instruction;
+};
+
+struct Edge {
+  size_t from;
+  size_t to;
+};
+
+/// Slot where the probe sequence for an event id starts.
+static size_t event_slot(unsigned int event_id, size_t size) {
+  // Mix all the bits of the id into the low ones (MurmurHash3 finalizer)
+  unsigned int h = event_id;
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return (size_t)h & (size - 1);
+}
+
+/// Records an instruction as the last one of its event in the current phase.
+/// Entries of earlier phases count as empty, so the table is never cleared.
+/// @return Previous last instruction of the event in the phase, NO_INSTRUCTION if none.
+static size_t swap_last(struct EventLast* table, size_t size, unsigned int event_id, size_t phase,
+                        size_t instruction) {
+  size_t slot = event_slot(event_id, size);
+  while (table[slot].phase == phase && table[slot].event_id != event_id) {
+    slot = (slot + 1) & (size - 1);
+  }
+
+  size_t previous = table[slot].phase == phase ? table[slot].instruction : NO_INSTRUCTION;
+  table[slot] = (struct EventLast){event_id, phase, instruction};
+  return previous;
+}
+
+int depgraph_build(struct DependencyGraph* graph, const struct Program* program) {
+  size_t n = program->count;
+
+  // At most one edge from the previous instruction of the event and one
+  // from the previous CREATE or LIST per instruction
+  size_t table_size = 64;
+  while (table_size < 2 * n) table_size *= 2;
+
+  struct EventLast* table = calloc(table_size, sizeof(struct EventLast));
+  struct Edge* edges = malloc((2 * n + 1) * sizeof(struct Edge));
+  graph->pending = calloc(n + 1, sizeof(atomic_size_t));
+  graph->first_successor = calloc(n + 2, sizeof(size_t));
+  graph->successors = NULL;
+  graph->num_instructions = n;
+  if (table == NULL || edges == NULL || graph->pending == NULL || graph->first_successor == NULL) {
+    free(table);
+    free(edges);
+    depgraph_free(graph);
+    return 1;
+  }
+
+  size_t num_edges = 0;
+  size_t phase = 1, last_list = NO_INSTRUCTION;
+  for (size_t i = 0; i < n; i++) {
+    const struct Instruction* instruction = &program->instructions[i];
+
+    size_t previous;
+    switch (instruction->command) {
+      case CMD_CREATE:
+      case CMD_RESERVE:
+      case CMD_SHOW:
+        previous = swap_last(table, table_size, instruction->event_id, phase, i);
+        if (previous != NO_INSTRUCTION) {
+          edges[num_edges++] = (struct Edge){previous, i};
+        }
+        if (instruction->command != CMD_CREATE) {
+          break;
+        }
+        // CREATE also appends to the list of events
+        // fall through
+      case CMD_LIST_EVENTS:
+        // Events are listed in the order they were created in
+        if (last_list != NO_INSTRUCTION) {
+          edges[num_edges++] = (struct Edge){last_list, i};
+        }
+        last_list = i;
+        break;
+
+      case CMD_BARRIER:
+        phase++;
+        last_list = NO_INSTRUCTION;
+        break;
+
+      case CMD_WAIT:
+      case CMD_HELP:
+      case CMD_EMPTY:
+      case CMD_INVALID:
+      case EOC:
+        break;
+    }
+  }
+  free(table);
+
+  // Successors of each instruction, grouped by counting sort
+  graph->successors = malloc((num_edges + 1) * sizeof(size_t));
+  if (graph->successors == NULL) {
+    free(edges);
+    depgraph_free(graph);
+    return 1;
+  }
+  for (size_t e = 0; e < num_edges; e++) {
+    graph->first_successor[edges[e].from + 2]++;
+    atomic_fetch_add_explicit(&graph->pending[edges[e].to], 1, memory_order_relaxed);
+  }
+  for (size_t i = 2; i < n + 2; i++) {
+    graph->first_successor[i] += graph->first_successor[i - 1];
+  }
+  // first_successor[i + 1] now tells where the successors of i start, and
+  // moves to where they end as they are placed
+  for (size_t e = 0; e < num_edges; e++) {
+    graph->successors[graph->first_successor[edges[e].from + 1]++] = edges[e].to;
+  }
+  free(edges);
+  return 0;
+}
+
+void depgraph_free(struct DependencyGraph* graph) {
+  free(graph->pending);
+  free(graph->first_successor);
+  free(graph->successors);
+  graph->pending = NULL;
+  graph->first_successor = NULL;
+  graph->successors = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef EMS_DEPGRAPH_H
+#define EMS_DEPGRAPH_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "program.h"
+
+/// Order that must be kept between the instructions of a program for a
+/// concurrent run to give the same results as running them one by one:
+///   - CREATE, RESERVE and SHOW of an event run after the previous one of the same event.
+///   - CREATE and LIST run after the previous CREATE or LIST, as both go through the list of events.
+/// No edge crosses a BARRIER. WAIT and HELP have no edges, nor does any
+/// instruction depend on them.
+struct DependencyGraph {
+  atomic_size_t* pending;   /// Number of unfinished predecessors of each instruction.
+  size_t* first_successor;  /// Successors of instruction i are successors[first_successor[i]] up
+                            /// to successors[first_successor[i + 1]], exclusive.
+  size_t* successors;
+  size_t num_instructions;
+};
+
+/// Builds the dependency graph of a program.
+/// @param graph Graph to be filled in.
+/// @param program Program to be run.
+/// @return 0 if the graph was built successfully, 1 otherwise.
+int depgraph_build(struct DependencyGraph* graph, const struct Program* program);
+
+/// Frees the arrays of a dependency graph.
+/// @param graph Graph to be freed.
+void depgraph_free(struct DependencyGraph* graph);
+
+#endif  // EMS_DEPGRAPH_H
@@ -1,69 +1,424 @@
 #include "eventlist.h"
 
+#include <stdalign.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "stats.h"
+
+#define INITIAL_INDEX_SIZE 64
+
+#define CACHE_LINE_SIZE 64
+
+/// Size of the blocks events are carved from. Events that do not fit in
+/// one get a block of their own.
+#define LIST_BLOCK_SIZE (256 * 1024)
+
+/// Largest event whose one byte seat ids are kept inside its slot. The ids
+/// of bigger events get an allocation of their own, which can be freed
+/// once the event is widened.
+#define MAX_INLINE_SEATS 4096
+
+/// Chunk of memory holding events back to back.
+struct ListBlock {
+  struct ListBlock* next;
+  size_t size;  // Usable bytes, starting at the first cache line after the header
+  size_t used;  // Bytes handed out so far
+};
+
+/// An event, its list node and the arrays that follow them in a block.
+struct EventSlot {
+  alignas(CACHE_LINE_SIZE) struct Event event;
+  struct ListNode node;
+  size_t size;                  // Bytes of the slot, arrays included
+  struct EventSlot* next_free;  // Next discarded slot
+};
+
+static size_t cache_align(size_t size) { return (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1); }
+
+static struct EventSlot* slot_of(struct Event* event) {
+  return (struct EventSlot*)((char*)event - offsetof(struct EventSlot, event));
+}
+
+/// First cache line of a block that can be handed out.
+static char* block_data(struct ListBlock* block) {
+  uintptr_t start = (uintptr_t)(block + 1);
+  return (char*)((start + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+}
+
+static struct ListBlock* create_block(size_t size) {
+  // Room to move the data up to a cache line, arena memory is only aligned to 16 bytes
+  struct ListBlock* block = arena_alloc(sizeof(struct ListBlock) + CACHE_LINE_SIZE + size);
+  if (!block) return NULL;
+
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+/// Slot where the probe sequence for an event id starts.
+static size_t index_slot(unsigned int event_id, size_t index_size) {
+  // Mix all the bits of the id into the low ones (MurmurHash3 finalizer)
+  unsigned int h = event_id;
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return (size_t)h & (index_size - 1);
+}
+
+static struct EventIndex* create_index(size_t size) {
+  struct EventIndex* index = (struct EventIndex*)arena_alloc(sizeof(struct EventIndex) + size * sizeof(struct Event*));
+  if (!index) return NULL;
+
+  index->size = size;
+  index->retired = NULL;
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&index->slots[i], NULL);
+  }
+  return index;
+}
+
+static struct Event* index_find(struct EventIndex* index, unsigned int event_id) {
+  size_t slot = index_slot(event_id, index->size);
+  struct Event* event;
+  while ((event = atomic_load_explicit(&index->slots[slot], memory_order_acquire)) != NULL) {
+    if (event->id == event_id) {
+      return event;
+    }
+    slot = (slot + 1) & (index->size - 1);
+  }
+  return NULL;
+}
+
+static void index_insert(struct EventIndex* index, struct Event* event) {
+  size_t slot = index_slot(event->id, index->size);
+  while (atomic_load_explicit(&index->slots[slot], memory_order_relaxed) != NULL) {
+    slot = (slot + 1) & (index->size - 1);
+  }
+  // Release: readers that find the event also see it fully initialized
+  atomic_store_explicit(&index->slots[slot], event, memory_order_release);
+}
+
+/// Publishes a table twice the size of the current one.
+/// @note Must be called with the list lock held.
+static int grow_index(struct EventList* list) {
+  struct EventIndex* old_index = atomic_load_explicit(&list->index, memory_order_relaxed);
+  struct EventIndex* new_index = create_index(old_index->size * 2);
+  if (!new_index) return 1;
+
+  for (size_t i = 0; i < old_index->size; i++) {
+    struct Event* event = atomic_load_explicit(&old_index->slots[i], memory_order_relaxed);
+    if (event != NULL) {
+      index_insert(new_index, event);
+    }
+  }
+
+  // Readers may still be probing the old table, it is only freed with the list
+  new_index->retired = old_index;
+  atomic_store_explicit(&list->index, new_index, memory_order_release);
+  return 0;
+}
 
 struct EventList* create_list() {
-  struct EventList* list = (struct EventList*)malloc(sizeof(struct EventList));
+  struct EventList* list = (struct EventList*)arena_alloc(sizeof(struct EventList));
   if (!list) return NULL;
-  list->head = NULL;
+  atomic_init(&list->head, NULL);
   list->tail = NULL;
+  list->count = 0;
+  list->blocks = NULL;
+  list->current = NULL;
+  list->free_slots = NULL;
+
+  struct EventIndex* index = create_index(INITIAL_INDEX_SIZE);
+  if (!index) {
+    arena_free(list);
+    return NULL;
+  }
+  atomic_init(&list->index, index);
+
+  if (arena_mutex_init(&list->lock) != 0) {
+    arena_free(index);
+    arena_free(list);
+    return NULL;
+  }
   return list;
 }
 
+/// Finds room for a slot of the given size, reusing discarded slots and
+/// blocks emptied by reset_list before allocating a new block.
+/// @note Must be called with the list lock held.
+static struct EventSlot* take_slot(struct EventList* list, size_t size) {
+  for (struct EventSlot** link = &list->free_slots; *link != NULL; link = &(*link)->next_free) {
+    if ((*link)->size >= size) {
+      struct EventSlot* slot = *link;
+      *link = slot->next_free;
+      return slot;
+    }
+  }
+
+  struct ListBlock* block = list->current;
+  while (block != NULL && block->size - block->used < size) {
+    block = block->next;
+  }
+
+  if (block == NULL) {
+    block = create_block(size > LIST_BLOCK_SIZE ? size : LIST_BLOCK_SIZE);
+    if (!block) return NULL;
+
+    // Blocks stay in allocation order, so after a reset they are refilled from the first
+    struct ListBlock** link = list->current ? &list->current->next : &list->blocks;
+    while (*link != NULL) link = &(*link)->next;
+    *link = block;
+  }
+  list->current = block;
+
+  struct EventSlot* slot = (struct EventSlot*)(block_data(block) + block->used);
+  block->used += size;
+  slot->size = size;
+  return slot;
+}
+
+struct Event* alloc_event(struct EventList* list, size_t num_seats, size_t num_locks, int profiled) {
+  if (!list) return NULL;
+  if (num_locks > SIZE_MAX / 2 / sizeof(pthread_mutex_t) || num_seats > SIZE_MAX / 2 / sizeof(atomic_uint)) return NULL;
+
+  size_t locks_offset = cache_align(sizeof(struct EventSlot));
+  size_t profiles_offset = locks_offset + cache_align(num_locks * sizeof(pthread_mutex_t));
+  size_t occupied_offset = profiles_offset + (profiled ? cache_align(num_locks * sizeof(struct LockProfile)) : 0);
+  size_t store_offset = occupied_offset + cache_align((num_seats + OCCUPIED_BITS - 1) / OCCUPIED_BITS * sizeof(atomic_ulong));
+  size_t ids_offset = store_offset + cache_align(sizeof(struct SeatStore));
+  int inline_seats = num_seats <= MAX_INLINE_SEATS;
+  size_t size = inline_seats ? ids_offset + cache_align(num_seats) : store_offset;
+
+  pthread_mutex_lock(&list->lock);
+  struct EventSlot* slot = take_slot(list, size);
+  pthread_mutex_unlock(&list->lock);
+  if (!slot) return NULL;
+
+  char* base = (char*)slot;
+  struct Event* event = &slot->event;
+  event->locks = (pthread_mutex_t*)(base + locks_offset);
+  event->num_locks = num_locks;
+  event->lock_profiles = profiled ? (struct LockProfile*)(base + profiles_offset) : NULL;
+  event->occupied = (atomic_ulong*)(base + occupied_offset);
+
+  struct SeatStore* store;
+  if (inline_seats) {
+    store = (struct SeatStore*)(base + store_offset);
+    store->width = 1;
+    store->owned = 0;
+    store->ids = (unsigned char*)(base + ids_offset);
+  } else if ((store = create_seat_store(num_seats, 1)) == NULL) {
+    atomic_init(&event->seats, NULL);
+    event->sparse = NULL;
+    discard_event(list, event);
+    return NULL;
+  }
+  atomic_init(&event->seats, store);
+  event->sparse = NULL;
+  return event;
+}
+
+struct SeatStore* create_seat_store(size_t num_seats, size_t width) {
+  if (num_seats > SIZE_MAX / width) return NULL;
+
+  struct SeatStore* store = arena_calloc(1, sizeof(struct SeatStore) + num_seats * width);
+  if (!store) return NULL;
+
+  store->width = width;
+  store->owned = 1;
+  store->ids = (unsigned char*)(store + 1);
+  return store;
+}
+
+void free_seat_store(struct SeatStore* store) {
+  if (store && store->owned) {
+    arena_free(store);
+  }
+}
+
+/// Slot where the probe sequence for a seat of a sparse event starts.
+static size_t sparse_slot(size_t seat, size_t size) {
+  // Mix all the bits of the index into the low ones (MurmurHash3 64-bit finalizer)
+  uint64_t h = seat;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return (size_t)h & (size - 1);
+}
+
+struct SparseSeats* create_sparse_seats(size_t size) {
+  if (size > (SIZE_MAX - sizeof(struct SparseSeats)) / sizeof(struct SparseSeat)) return NULL;
+
+  // Zeroed slots are empty
+  struct SparseSeats* seats = arena_calloc(1, sizeof(struct SparseSeats) + size * sizeof(struct SparseSeat));
+  if (!seats) return NULL;
+
+  seats->size = size;
+  seats->count = 0;
+  return seats;
+}
+
+unsigned int sparse_seat_get(const struct SparseSeats* seats, size_t seat) {
+  for (size_t slot = sparse_slot(seat, seats->size); seats->slots[slot].id != 0; slot = (slot + 1) & (seats->size - 1)) {
+    if (seats->slots[slot].seat == seat) {
+      return seats->slots[slot].id;
+    }
+  }
+  return 0;
+}
+
+void sparse_seat_set(struct SparseSeats* seats, size_t seat, unsigned int id) {
+  size_t slot = sparse_slot(seat, seats->size);
+  while (seats->slots[slot].id != 0) {
+    slot = (slot + 1) & (seats->size - 1);
+  }
+  seats->slots[slot].seat = seat;
+  seats->slots[slot].id = id;
+  seats->count++;
+}
+
+int sparse_seats_reserve(struct SparseSeats** seats, size_t extra) {
+  struct SparseSeats* old_seats = *seats;
+
+  // Keep the load factor at or below 1/2 so probe sequences stay short
+  size_t size = old_seats->size;
+  while ((old_seats->count + extra) * 2 > size) size *= 2;
+  if (size == old_seats->size) return 0;
+
+  struct SparseSeats* new_seats = create_sparse_seats(size);
+  if (!new_seats) return 1;
+
+  for (size_t i = 0; i < old_seats->size; i++) {
+    if (old_seats->slots[i].id != 0) {
+      sparse_seat_set(new_seats, old_seats->slots[i].seat, old_seats->slots[i].id);
+    }
+  }
+  // Readers hold the same lock as the writers, so the old table can go right away
+  arena_free(old_seats);
+  *seats = new_seats;
+  return 0;
+}
+
+/// Frees the seat stores and sparse tables allocated apart from their
+/// events, the rest of their memory goes with the blocks.
+static void free_seat_stores(struct EventList* list) {
+  for (struct ListNode* node = atomic_load(&list->head); node != NULL; node = atomic_load(&node->next)) {
+    free_seat_store(atomic_load(&node->event->seats));
+    arena_free(node->event->sparse);
+  }
+}
+
+void discard_event(struct EventList* list, struct Event* event) {
+  if (!list || !event) return;
+
+  struct EventSlot* slot = slot_of(event);
+  free_seat_store(atomic_load(&event->seats));
+  arena_free(event->sparse);
+  pthread_mutex_lock(&list->lock);
+  slot->next_free = list->free_slots;
+  list->free_slots = slot;
+  pthread_mutex_unlock(&list->lock);
+}
+
 int append_to_list(struct EventList* list, struct Event* event) {
   if (!list) return 1;
 
-  struct ListNode* new_node = (struct ListNode*)malloc(sizeof(struct ListNode));
-  if (!new_node) return 1;
-
+  struct ListNode* new_node = &slot_of(event)->node;
   new_node->event = event;
-  new_node->next = NULL;
+  atomic_init(&new_node->next, NULL);
 
-  if (list->head == NULL) {
-    list->head = new_node;
-    list->tail = new_node;
+  pthread_mutex_lock(&list->lock);
+
+  // Checked under the lock, so two concurrent appends of one id cannot both succeed
+  if (index_find(atomic_load_explicit(&list->index, memory_order_relaxed), event->id) != NULL) {
+    pthread_mutex_unlock(&list->lock);
+    return EVENT_EXISTS;
+  }
+
+  // Keep the load factor at or below 1/2 so probe sequences stay short
+  struct EventIndex* index = atomic_load_explicit(&list->index, memory_order_relaxed);
+  if ((list->count + 1) * 2 > index->size) {
+    if (grow_index(list) != 0) {
+      pthread_mutex_unlock(&list->lock);
+      return 1;
+    }
+    index = atomic_load_explicit(&list->index, memory_order_relaxed);
+  }
+
+  if (list->tail == NULL) {
+    atomic_store_explicit(&list->head, new_node, memory_order_release);
   } else {
-    list->tail->next = new_node;
-    list->tail = new_node;
+    atomic_store_explicit(&list->tail->next, new_node, memory_order_release);
   }
+  list->tail = new_node;
+
+  index_insert(index, event);
+  list->count++;
 
+  pthread_mutex_unlock(&list->lock);
   return 0;
 }
 
-static void free_event(struct Event* event) {
-  if (!event) return;
+void reset_list(struct EventList* list) {
+  if (!list) return;
+
+  free_seat_stores(list);
+  atomic_store(&list->head, NULL);
+  list->tail = NULL;
+  list->count = 0;
+  list->free_slots = NULL;
+  for (struct ListBlock* block = list->blocks; block != NULL; block = block->next) {
+    block->used = 0;
+  }
+  list->current = list->blocks;
 
-  free(event->data);
-  free(event->mutex);
-  free(event);
+  // Keep the current table, only the ones it replaced are freed
+  struct EventIndex* index = atomic_load(&list->index);
+  struct EventIndex* retired = index->retired;
+  while (retired) {
+    struct EventIndex* next = retired->retired;
+    arena_free(retired);
+    retired = next;
+  }
+  index->retired = NULL;
+  for (size_t i = 0; i < index->size; i++) {
+    atomic_store_explicit(&index->slots[i], NULL, memory_order_relaxed);
+  }
 }
 
 void free_list(struct EventList* list) {
   if (!list) return;
 
-  struct ListNode* current = list->head;
-  while (current) {
-    struct ListNode* temp = current;
-    current = current->next;
+  // Events and their nodes live in the blocks, so they go with them
+  free_seat_stores(list);
+  struct ListBlock* block = list->blocks;
+  while (block) {
+    struct ListBlock* next = block->next;
+    arena_free(block);
+    block = next;
+  }
 
-    free_event(temp->event);
-    free(temp);
+  struct EventIndex* index = atomic_load(&list->index);
+  while (index) {
+    struct EventIndex* retired = index->retired;
+    arena_free(index);
+    index = retired;
   }
 
-  free(list);
+  pthread_mutex_destroy(&list->lock);
+  arena_free(list);
 }
 
 struct Event* get_event(struct EventList* list, unsigned int event_id) {
   if (!list) return NULL;
 
-  struct ListNode* current = list->head;
-  while (current) {
-    struct Event* event = current->event;
-    if (event->id == event_id) {
-      return event;
-    }
-    current = current->next;
-  }
-
-  return NULL;
-}
\ No newline at end of file
+  return index_find(atomic_load_explicit(&list->index, memory_order_acquire), event_id);
+}
@@ -2,49 +2,182 @@
 #define EVENT_LIST_H
 
 #include <stddef.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+struct LockProfile;
+struct ListBlock;
+struct EventSlot;
+
+/// Reservation ids of the seats of an event, each stored in `width` bytes.
+/// Events start with one byte per seat and move to a wider store once a
+/// reservation id no longer fits.
+struct SeatStore {
+  size_t width;          /// Bytes per reservation id: 1, 2 or 4.
+  int owned;             /// Whether the store was allocated on its own rather than inside the event.
+  unsigned char* ids;    /// Array of rows * cols ids, 0 for a free seat.
+};
+
+/// A taken seat of a sparse event.
+struct SparseSeat {
+  size_t seat;          /// Index of the seat.
+  unsigned int id;      /// Reservation id, 0 marks an empty slot of the table.
+};
+
+/// Taken seats of an event too large to store every seat of, in an
+/// open-addressing hash table over the seat indexes.
+struct SparseSeats {
+  size_t size;                 /// Number of slots, always a power of two.
+  size_t count;                /// Number of taken seats.
+  struct SparseSeat slots[];   /// Linear probing.
+};
+
 struct Event {
   unsigned int id;            /// Event id
-  unsigned int reservations;  /// Number of reservations for the event.
+  atomic_uint reservations;   /// Number of reservations for the event, also the last reservation id.
 
   size_t cols;  /// Number of columns.
   size_t rows;  /// Number of rows.
 
-  unsigned int* data;  /// Array of size rows * cols with the reservations for each seat.
-  pthread_mutex_t* mutex;
+  _Atomic(struct SeatStore*) seats;  /// Reservation id of each seat, replaced when widened.
+  atomic_ulong* occupied;            /// Bitmap of the rows * cols seats, set once a seat is taken.
+  struct SparseSeats* sparse;        /// Taken seats instead of the two above for sparse events, guarded
+                                     /// by their only lock, which replaces it as it grows. NULL for other events.
+  int is_sparse;                     /// Whether the event keeps its seats in sparse. Set at creation and never
+                                     /// changed, so it can be read without the lock.
+
+  atomic_uint writers;    /// Reservations currently writing seat ids.
+  atomic_uint widening;   /// Set while the seats move to a wider store, which holds off writers.
+  atomic_uint gated_shows;  /// SHOWs that gave up on lock-free snapshots, which hold off writers.
+  atomic_uint seats_generation;  /// Number of times the seats were widened.
+  atomic_uint seat_readers[2];   /// Snapshots reading the seats, by parity of the generation they started in.
+  atomic_ulong version;   /// Bumped after every reservation, for consistent snapshots of the seats.
+
+  pthread_mutex_t* locks;  /// Seat locks, each guarding a row, a stripe or a hashed set of seats.
+  size_t num_locks;        /// Number of locks.
+
+  struct LockProfile* lock_profiles;  /// Contention of each lock, NULL unless lock profiling is on.
+  atomic_ulong snapshot_retries;      /// SHOW snapshots redone because a reservation was writing.
 };
 
 struct ListNode {
   struct Event* event;
-  struct ListNode* next;
+  _Atomic(struct ListNode*) next;
 };
 
-// Linked list structure
+// Open-addressing hash table over the event ids. A table is never modified
+// in place once it is replaced by a bigger one, so readers need no locks.
+struct EventIndex {
+  size_t size;                       // Number of slots, always a power of two
+  struct EventIndex* retired;        // Older table, kept alive for readers still probing it
+  _Atomic(struct Event*) slots[];    // Linear probing, NULL marks an empty slot
+};
+
+// Linked list structure, with a hash index over the event ids.
+// The list keeps the creation order, the index gives constant time lookups.
+// Lookups and traversals never block. Appends are serialized by the lock.
 struct EventList {
-  struct ListNode* head;  // Head of the list
-  struct ListNode* tail;  // Tail of the list
+  _Atomic(struct ListNode*) head;       // Head of the list
+  struct ListNode* tail;                // Tail of the list
+
+  _Atomic(struct EventIndex*) index;    // Current hash index
+  size_t count;                         // Number of events in the list
+  pthread_mutex_t lock;                 // Held while appending or allocating
+
+  struct ListBlock* blocks;             // Memory the events and their nodes are carved from
+  struct ListBlock* current;            // Block events are being carved from
+  struct EventSlot* free_slots;         // Events discarded before being appended, to be reused
 };
 
+/// Returned by append_to_list when an event with the same id is already in the list.
+#define EVENT_EXISTS 2
+
 /// Creates a new event list.
 /// @return Newly created event list, NULL on failure
 struct EventList* create_list();
 
-/// Appends a new node to the list.
+/// Number of bits in a word of the occupancy bitmap.
+#define OCCUPIED_BITS (8 * sizeof(unsigned long))
+
+/// Carves a new event out of the memory of a list. The event header, its
+/// seat locks, their profiles, the occupancy bitmap and a one byte wide seat
+/// store are laid out back to back, each starting on a cache line, next to
+/// the list node of the event. The seat ids of large events are allocated
+/// apart, so they can be freed once widened.
+/// @note Only seats, occupied, sparse (to NULL), locks, num_locks and
+/// lock_profiles are set, everything else is left for the caller to
+/// initialize, including the contents of the arrays.
+/// @param list Event list the event will be appended to.
+/// @param num_seats Number of seats of the event.
+/// @param num_locks Number of seat locks of the event.
+/// @param profiled Whether to make room for a LockProfile per lock.
+/// @return Newly allocated event, NULL on failure.
+struct Event* alloc_event(struct EventList* list, size_t num_seats, size_t num_locks, int profiled);
+
+/// Allocates a seat store to widen the seats of an event to.
+/// @param num_seats Number of seats of the event.
+/// @param width Bytes per reservation id.
+/// @return Newly allocated store, with every id set to 0, NULL on failure.
+struct SeatStore* create_seat_store(size_t num_seats, size_t width);
+
+/// Frees a seat store, unless it lives inside its event.
+/// @param store Store to be freed.
+void free_seat_store(struct SeatStore* store);
+
+/// Allocates an empty table of taken seats for a sparse event.
+/// @param size Number of slots, a power of two.
+/// @return Newly allocated table, NULL on failure.
+struct SparseSeats* create_sparse_seats(size_t size);
+
+/// Gets the reservation id of a seat of a sparse event.
+/// @param seats Table of taken seats.
+/// @param seat Index of the seat.
+/// @return Reservation id, 0 if the seat is free.
+unsigned int sparse_seat_get(const struct SparseSeats* seats, size_t seat);
+
+/// Makes room in a table of taken seats, replacing it with a bigger one if needed.
+/// @param seats Table to grow, updated if it is replaced.
+/// @param extra Number of seats about to be added.
+/// @return 0 if there is room, 1 if memory ran out.
+int sparse_seats_reserve(struct SparseSeats** seats, size_t extra);
+
+/// Marks a free seat of a sparse event taken.
+/// @note Room must have been made with sparse_seats_reserve.
+/// @param seats Table of taken seats.
+/// @param seat Index of the seat.
+/// @param id Reservation id, not 0.
+void sparse_seat_set(struct SparseSeats* seats, size_t seat, unsigned int id);
+
+/// Gives back an event that could not be appended, so a later alloc_event can reuse it.
+/// @param list Event list the event was allocated from.
+/// @param event Event returned by alloc_event.
+void discard_event(struct EventList* list, struct Event* event);
+
+/// Appends a new node to the list and indexes its event, unless an event
+/// with the same id is already there.
+/// @note Safe to call concurrently. The event must be fully initialized, it
+/// becomes visible to other threads as soon as it is appended.
 /// @param list Event list to be modified.
-/// @param data Event to be stored in the new node.
-/// @return 0 if the node was appended successfully, 1 otherwise.
+/// @param data Event to be stored in the new node, returned by alloc_event.
+/// @return 0 if the node was appended successfully, EVENT_EXISTS if the id
+/// is taken, 1 otherwise.
 int append_to_list(struct EventList* list, struct Event* data);
 
-/// Removes a node from the list.
-/// @param list Event list to be modified.
-/// @return 0 if the node was removed successfully, 1 otherwise.
+/// Removes every event from a list, keeping its memory for the events
+/// created next.
+/// @note No other thread may be using the list or its events.
+/// @param list Event list to be emptied.
+void reset_list(struct EventList* list);
+
+/// Frees a list and all of its events at once.
+/// @param list Event list to be freed.
 void free_list(struct EventList* list);
 
 /// Retrieves an event in the list.
+/// @note Safe to call concurrently with append_to_list, never blocks.
 /// @param list Event list to be searched
 /// @param event_id Event id.
 /// @return Pointer to the event if found, NULL otherwise.
 struct Event* get_event(struct EventList* list, unsigned int event_id);
 
-#endif  // EVENT_LIST_H
\ No newline at end of file
+#endif  // EVENT_LIST_H
@@ -0,0 +1,288 @@
+#include "jobsb.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+
+/// Opcodes of the compiled format. Never renumber them, compiled files keep them.
+enum Opcode {
+  OP_CREATE = 1,
+  OP_RESERVE = 2,
+  OP_SHOW = 3,
+  OP_LIST = 4,
+  OP_WAIT = 5,
+  OP_BARRIER = 6,
+  OP_HELP = 7,
+  OP_RESERVE_BATCH = 8,
+};
+
+/// Length of the fixed part of the header: magic and version.
+#define HEADER_SIZE 5
+
+/// Longest varint of an unsigned int.
+#define MAX_VARINT_SIZE 5
+
+static char* put_varint(char* out, size_t value) {
+  while (value >= 0x80) {
+    *out++ = (char)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  *out++ = (char)value;
+  return out;
+}
+
+/// Reads a varint that must fit in an unsigned int.
+/// @return 0 if a value was read, 1 if the input is truncated or the value too large.
+static int get_varint(const unsigned char** pos, const unsigned char* end, unsigned int* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 7 * MAX_VARINT_SIZE; shift += 7) {
+    if (*pos == end) return 1;
+    unsigned char byte = *(*pos)++;
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      if (result > UINT_MAX) return 1;
+      *value = (unsigned int)result;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/// Reads the coordinates of a reservation into the coordinate pool of a program.
+/// @note The pool must have room for them.
+/// @return 0 if the coordinates were read, 1 if the input is malformed.
+static int get_seats(const unsigned char** pos, const unsigned char* end, struct Program* program, unsigned int seats) {
+  for (unsigned int j = 0; j < seats; j++) {
+    if (get_varint(pos, end, &program->xs[program->num_seats]) != 0 ||
+        get_varint(pos, end, &program->ys[program->num_seats]) != 0)
+      return 1;
+    program->num_seats++;
+  }
+  return 0;
+}
+
+/// Makes room for the sizes of a batched reservation in the size pool of a program.
+static int grow_sizes(struct Program* program, size_t extra) {
+  if (program->num_sizes + extra <= program->sizes_capacity) return 0;
+
+  size_t capacity = program->sizes_capacity ? program->sizes_capacity * 2 : 64;
+  if (capacity < program->num_sizes + extra) capacity = program->num_sizes + extra;
+  unsigned int* sizes = realloc(program->sizes, capacity * sizeof(unsigned int));
+  if (sizes == NULL) return 1;
+
+  program->sizes = sizes;
+  program->sizes_capacity = capacity;
+  return 0;
+}
+
+int jobsb_encode(const struct Program* program, struct OutputBuffer* buffer) {
+  char* out = outbuf_reserve(buffer, HEADER_SIZE + 2 * 10);
+  if (out == NULL) return 1;
+  memcpy(out, JOBSB_MAGIC, 4);
+  out[4] = JOBSB_VERSION;
+  out = put_varint(out + HEADER_SIZE, program->count);
+  out = put_varint(out, program->num_seats);
+  buffer->len = (size_t)(out - buffer->data);
+
+  for (size_t i = 0; i < program->count; i++) {
+    const struct Instruction* instruction = &program->instructions[i];
+
+    // opcode, then at most 3 operands or the seats, plus the size of each
+    // reservation of a batch. args[0] only counts reservations in a batch.
+    size_t operands = 3 + 2 * instruction->num_seats;
+    if (instruction->command == CMD_RESERVE && instruction->args[0] > 1) {
+      operands += instruction->args[0];
+    }
+    out = outbuf_reserve(buffer, 1 + MAX_VARINT_SIZE * operands);
+    if (out == NULL) return 1;
+
+    switch (instruction->command) {
+      case CMD_CREATE:
+        *out++ = OP_CREATE;
+        out = put_varint(out, instruction->event_id);
+        out = put_varint(out, instruction->args[0]);
+        out = put_varint(out, instruction->args[1]);
+        break;
+
+      case CMD_RESERVE:
+        if (instruction->args[0] > 1) {
+          *out++ = OP_RESERVE_BATCH;
+          out = put_varint(out, instruction->event_id);
+          out = put_varint(out, instruction->args[0]);
+          size_t seat = instruction->first_seat;
+          for (size_t j = 0; j < instruction->args[0]; j++) {
+            unsigned int size = program->sizes[instruction->args[1] + j];
+            out = put_varint(out, size);
+            for (unsigned int k = 0; k < size; k++, seat++) {
+              out = put_varint(out, program->xs[seat]);
+              out = put_varint(out, program->ys[seat]);
+            }
+          }
+          break;
+        }
+        *out++ = OP_RESERVE;
+        out = put_varint(out, instruction->event_id);
+        out = put_varint(out, instruction->num_seats);
+        for (size_t j = 0; j < instruction->num_seats; j++) {
+          out = put_varint(out, program->xs[instruction->first_seat + j]);
+          out = put_varint(out, program->ys[instruction->first_seat + j]);
+        }
+        break;
+
+      case CMD_SHOW:
+        *out++ = OP_SHOW;
+        out = put_varint(out, instruction->event_id);
+        break;
+
+      case CMD_WAIT:
+        *out++ = OP_WAIT;
+        out = put_varint(out, instruction->args[0]);
+        out = put_varint(out, instruction->args[1]);
+        break;
+
+      case CMD_LIST_EVENTS:
+        *out++ = OP_LIST;
+        break;
+
+      case CMD_BARRIER:
+        *out++ = OP_BARRIER;
+        break;
+
+      case CMD_HELP:
+        *out++ = OP_HELP;
+        break;
+
+      case CMD_EMPTY:
+      case CMD_INVALID:
+      case EOC:
+        // never stored in a program
+        return 1;
+    }
+    buffer->len = (size_t)(out - buffer->data);
+  }
+  return 0;
+}
+
+struct Program* jobsb_decode(const char* data, size_t len) {
+  const unsigned char* pos = (const unsigned char*)data;
+  const unsigned char* end = pos + len;
+  unsigned int count, num_seats;
+
+  if (len < HEADER_SIZE || memcmp(data, JOBSB_MAGIC, 4) != 0 || data[4] != JOBSB_VERSION) {
+    fprintf(stderr, "Not a compiled job file\n");
+    return NULL;
+  }
+  pos += HEADER_SIZE;
+  // Every instruction takes at least one byte and every seat two, which
+  // bounds what a damaged header can make us allocate
+  if (get_varint(&pos, end, &count) != 0 || get_varint(&pos, end, &num_seats) != 0 ||
+      count > (size_t)(end - pos) || num_seats > (size_t)(end - pos) / 2) {
+    fprintf(stderr, "Malformed compiled job file\n");
+    return NULL;
+  }
+
+  struct Program* program = calloc(1, sizeof(struct Program));
+  if (program == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    return NULL;
+  }
+  program->instructions = malloc((count ? count : 1) * sizeof(struct Instruction));
+  program->xs = malloc((num_seats ? num_seats : 1) * sizeof(unsigned int));
+  program->ys = malloc((num_seats ? num_seats : 1) * sizeof(unsigned int));
+  if (program->instructions == NULL || program->xs == NULL || program->ys == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    program_free(program);
+    return NULL;
+  }
+  program->capacity = count;
+  program->seats_capacity = num_seats;
+
+  for (size_t i = 0; i < count; i++) {
+    struct Instruction* instruction = &program->instructions[i];
+    unsigned int seats, reservations;
+    memset(instruction, 0, sizeof(*instruction));
+    if (pos == end) goto malformed;
+
+    switch (*pos++) {
+      case OP_CREATE:
+        instruction->command = CMD_CREATE;
+        if (get_varint(&pos, end, &instruction->event_id) != 0 || get_varint(&pos, end, &instruction->args[0]) != 0 ||
+            get_varint(&pos, end, &instruction->args[1]) != 0)
+          goto malformed;
+        break;
+
+      case OP_RESERVE:
+        instruction->command = CMD_RESERVE;
+        if (get_varint(&pos, end, &instruction->event_id) != 0 || get_varint(&pos, end, &seats) != 0 || seats == 0 ||
+            seats >= MAX_RESERVATION_SIZE || seats > num_seats - program->num_seats)
+          goto malformed;
+        instruction->args[0] = 1;
+        instruction->first_seat = program->num_seats;
+        instruction->num_seats = seats;
+        if (get_seats(&pos, end, program, seats) != 0) goto malformed;
+        break;
+
+      case OP_RESERVE_BATCH:
+        instruction->command = CMD_RESERVE;
+        if (get_varint(&pos, end, &instruction->event_id) != 0 || get_varint(&pos, end, &reservations) != 0 ||
+            reservations < 2 || reservations > MAX_BATCH_SIZE)
+          goto malformed;
+        instruction->args[0] = reservations;
+        instruction->args[1] = (unsigned int)program->num_sizes;
+        instruction->first_seat = program->num_seats;
+        if (grow_sizes(program, reservations) != 0) {
+          fprintf(stderr, "Memory allocation error\n");
+          program_free(program);
+          return NULL;
+        }
+        for (unsigned int j = 0; j < reservations; j++) {
+          if (get_varint(&pos, end, &seats) != 0 || seats == 0 || seats >= MAX_RESERVATION_SIZE ||
+              seats > num_seats - program->num_seats || instruction->num_seats + seats >= MAX_BATCH_SEATS ||
+              get_seats(&pos, end, program, seats) != 0)
+            goto malformed;
+          program->sizes[program->num_sizes++] = seats;
+          instruction->num_seats += seats;
+        }
+        break;
+
+      case OP_SHOW:
+        instruction->command = CMD_SHOW;
+        if (get_varint(&pos, end, &instruction->event_id) != 0) goto malformed;
+        break;
+
+      case OP_WAIT:
+        instruction->command = CMD_WAIT;
+        if (get_varint(&pos, end, &instruction->args[0]) != 0 || get_varint(&pos, end, &instruction->args[1]) != 0)
+          goto malformed;
+        break;
+
+      case OP_LIST:
+        instruction->command = CMD_LIST_EVENTS;
+        break;
+
+      case OP_BARRIER:
+        instruction->command = CMD_BARRIER;
+        break;
+
+      case OP_HELP:
+        instruction->command = CMD_HELP;
+        break;
+
+      default:
+        goto malformed;
+    }
+    program->count++;
+  }
+  if (pos != end || program->num_seats != num_seats) goto malformed;
+
+  return program;
+
+malformed:
+  fprintf(stderr, "Malformed compiled job file\n");
+  program_free(program);
+  return NULL;
+}
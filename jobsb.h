@@ -0,0 +1,38 @@
+#ifndef EMS_JOBSB_H
+#define EMS_JOBSB_H
+
+#include <stddef.h>
+
+#include "outbuf.h"
+#include "program.h"
+
+/// Compiled job files (.jobsb) hold a program so that it can be loaded
+/// without tokenizing the text again:
+///
+///   "EMSB" | version | varint instruction count | varint seat count
+///   then per instruction, a one byte opcode followed by its operands:
+///     CREATE   id rows cols
+///     RESERVE  id n x1 y1 ... xn yn
+///     RESERVE  id m n1 x1 y1 ... n2 x1 y1 ... nm ...  (batch of m > 1 reservations)
+///     SHOW     id
+///     WAIT     delay thread_id (0 if none)
+///     LIST, BARRIER, HELP  no operands
+///
+/// Every operand is an unsigned LEB128 varint.
+
+#define JOBSB_MAGIC "EMSB"
+#define JOBSB_VERSION 1
+
+/// Appends the compiled form of a program to a buffer.
+/// @param program Program to be compiled.
+/// @param buffer Buffer to append to.
+/// @return 0 if the program was compiled successfully, 1 otherwise.
+int jobsb_encode(const struct Program* program, struct OutputBuffer* buffer);
+
+/// Loads a compiled job file.
+/// @param data Contents of the file, e.g. mapped with mmap.
+/// @param len Length of the contents, in bytes.
+/// @return Newly created program, NULL if the file is malformed or memory ran out.
+struct Program* jobsb_decode(const char* data, size_t len);
+
+#endif  // EMS_JOBSB_H
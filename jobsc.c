@@ -0,0 +1,79 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobsb.h"
+#include "outbuf.h"
+#include "parser.h"
+#include "program.h"
+
+// Compiles a .jobs file into a .jobsb file that ems loads without parsing.
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: jobsc <file.jobs> [output.jobsb]\n");
+    return 1;
+  }
+
+  const char *in_path = argv[1];
+  char *out_path;
+  if (argc == 3) {
+    out_path = strdup(argv[2]);
+  } else {
+    // same name with a b appended, a.jobs becomes a.jobsb
+    size_t len = strlen(in_path);
+    out_path = malloc(len + 2);
+    if (out_path != NULL) {
+      strcpy(out_path, in_path);
+      strcat(out_path, "b");
+    }
+  }
+  if (out_path == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    return 1;
+  }
+
+  int fd_in = open(in_path, O_RDONLY);
+  if (fd_in < 0) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    free(out_path);
+    return 1;
+  }
+  struct Program *program = program_parse(fd_in);
+  parser_release(fd_in);
+  close(fd_in);
+  if (program == NULL) {
+    fprintf(stderr, "Failed to parse %s\n", in_path);
+    free(out_path);
+    return 1;
+  }
+
+  struct OutputBuffer buffer = {NULL, 0, 0};
+  int failed = jobsb_encode(program, &buffer);
+  program_free(program);
+  if (failed) {
+    fprintf(stderr, "Failed to compile %s\n", in_path);
+    outbuf_free(&buffer);
+    free(out_path);
+    return 1;
+  }
+
+  int fd_out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_out < 0) {
+    fprintf(stderr, "Failed to open %s. Error: %s\n", out_path, strerror(errno));
+    failed = 1;
+  } else {
+    if (outbuf_flush(&buffer, fd_out) != 0) {
+      fprintf(stderr, "Failed to write %s\n", out_path);
+      failed = 1;
+    }
+    close(fd_out);
+  }
+
+  outbuf_free(&buffer);
+  free(out_path);
+  return failed;
+}
@@ -9,166 +9,1126 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include "constants.h"
+#include "depgraph.h"
+#include "jobsb.h"
 #include "operations.h"
 #include "parser.h"
+#include "program.h"
+#include "stats.h"
+#include "workqueue.h"
+#include "writer.h"
 
-pthread_mutex_t writing_locker;
+/// Progress of a job run with -d, shared by all of its threads.
+struct DependencyRun {
+  struct DependencyGraph graph;
+  atomic_size_t remaining;  // Instructions of the current phase not run yet, WAITs excluded
+  atomic_size_t queued;     // Bumped whenever instructions become ready to run
+  atomic_int idle;          // Threads sleeping on ready
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+};
 
 typedef struct ThreadArgs{
   int thread_id;
   int total_threads;
-  char* file_name;
-  int fd_out;
-  int start_line;
+  const struct Program* program;
+  struct OrderedWriter* writer;  // Writes SHOW and LIST output to the .out file in program order
+  struct OutputBuffer output;    // Output of the command being run
+  pthread_barrier_t* barrier;  // Shared by all the threads of the job, crossed at every BARRIER
+  struct WorkQueue* queues;    // One per thread, indexed by thread_id
+  struct JobPool* pool;        // Jobs shared by all the threads with -P, NULL otherwise
+  struct DependencyRun* run;   // Order between the instructions with -d, NULL otherwise
+
+  // Filled in by the thread for the utilization report
+  size_t executed;   // Commands run by this thread
+  size_t stolen;     // Of which were taken from another thread's queue
+  double busy_ms;    // Time spent running commands, WAITs excluded
+  struct LatencySamples latencies;  // Latency of each of those commands, with -S
 } ThreadArgs;
 
-typedef struct HandlerResult {
-    int barrier_state;   // 1 or 0 for boolean signaling
-    int curCmd;  // Some integer value
-} HandlerResult;
+#define USAGE \
+  "Usage: ems [-u] [-s] [-P] [-d] [-c threads] [-S file] [-M file] [-C] [-o] [-l row|stripe:N|hash:N] [-m MiB] <jobs_dir> <max_proc> <max_threads> [delay_ms]\n" \
+  "  -u  print per-thread utilization after each job and per-process at exit\n" \
+  "  -s  dispatch the largest job files first\n" \
+  "  -P  run every job in this process on one pool of max_proc * max_threads threads,\n" \
+  "      the jobs share their events\n" \
+  "  -d  run each command as soon as the earlier commands on its event are done, so the\n" \
+  "      .out files match a run with one thread without needing BARRIERs\n" \
+  "  -c  map large job files in memory and parse them with up to this many threads\n" \
+  "  -S  append throughput and latency percentiles of each job to a file, as JSON lines\n" \
+  "  -C  profile seat and output lock contention, report the most contended after each job\n" \
+  "  -M  append counters and latency histograms of every command type to a file at exit\n" \
+  "      and on SIGUSR1, as JSON lines\n" \
+  "  -l  seat locking: one lock per row (default), per N seats or N hashed locks per event\n" \
+  "  -o  reserve seats with compare-and-swap instead of locks\n" \
+  "  -m  share the events between all job processes, in MiB of shared memory\n"
 
-void* handle_commands (void * args){
-  ThreadArgs *cmdArgs = (ThreadArgs *)args;
-  enum Command cmd;
-  int fd_in = open(cmdArgs->file_name, O_RDONLY);
-  int thread_id = cmdArgs->thread_id;
-  int total_threads = cmdArgs->total_threads;
-  int fd_out = cmdArgs->fd_out;
-  int start_line = cmdArgs->start_line;
-  
-  int curCmd = 0; // tem de se mudar para cenários de barrier, em q o 1o comando desta vez é o q vem depois do barrier
-  while ((cmd = get_next(fd_in)) != EOC) {
-    unsigned int event_id, delay;
-    size_t num_rows, num_columns, num_coords;
-    size_t xs[MAX_RESERVATION_SIZE], ys[MAX_RESERVATION_SIZE];
-
-    fflush(stdout);
-
-    switch (cmd) {
-      case CMD_CREATE:
-        
-        if (parse_create(fd_in, &event_id, &num_rows, &num_columns) != 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
-        if (curCmd%total_threads==thread_id && curCmd>=start_line){
-          if (ems_create(event_id, num_rows, num_columns)) {
-            fprintf(stderr, "Failed to create event\n");
-          }
+static int print_utilization = 0;
+static int largest_first = 0;
+static int single_process = 0;
+static int dependency_order = 0;
+static int parse_threads = 1;
+static int stats_fd = -1;
+static int metrics_fd = -1;
+static volatile sig_atomic_t metrics_requested = 0;
+
+static void request_metrics(int sig) {
+  (void)sig;
+  metrics_requested = 1;
+}
+
+/// Writes the -M metrics if SIGUSR1 asked for them.
+static void dump_requested_metrics(void) {
+  if (metrics_requested) {
+    metrics_requested = 0;
+    if (metrics_dump(metrics_fd) != 0) {
+      fprintf(stderr, "Failed to write the metrics\n");
+    }
+  }
+}
+
+/// Name of a job file, sent to the job processes through the queue pipe.
+/// Fixed size and smaller than PIPE_BUF, so each write of one is atomic.
+struct JobRequest {
+  char name[256];
+};
+
+/// Job file found in the directory, with its size for -s.
+struct JobFile {
+  struct JobRequest request;
+  off_t size;
+};
+
+enum JobState { JOB_PENDING, JOB_LOADING, JOB_RUNNING, JOB_FINISHING, JOB_DONE };
+
+/// Job run by the shared thread pool of -P.
+struct PoolJob {
+  const char* name;
+  enum JobState state;
+  struct Program* program;
+  struct OrderedWriter writer;
+  int fd_out;
+
+  size_t next;               // Next instruction to be dispatched
+  size_t phase_end;          // BARRIER ending the current phase, or the end of the program
+  size_t in_flight;          // Instructions dispatched and not yet finished
+  struct timespec resume_at; // Set by WAIT, nothing is dispatched before it
+};
+
+/// Every job of the directory, run by one pool of threads. Each thread works on
+/// the first job with something to dispatch, so idle threads help the others.
+struct JobPool {
+  struct PoolJob* jobs;
+  size_t count;
+  size_t first_active;   // Jobs before it are done
+  const char* dir_str;
+
+  pthread_mutex_t lock;  // Protects everything above
+  pthread_cond_t changed;  // Signaled when a job may have become runnable
+
+  struct LockProfile writer_locks;  // Contention of the output writers of every job, with -C
+};
+
+/// Sent by each job process to the parent when it runs out of jobs.
+struct WorkerReport {
+  pid_t pid;
+  size_t jobs;       // Job files run
+  double busy_ms;    // Time spent running them
+  double alive_ms;   // From the start of the dispatch to the end of the last job
+};
+
+/// Parses the argument of -l.
+/// @return 0 if the granularity was set successfully, 1 otherwise.
+static int parse_lock_granularity(const char *arg) {
+  char *endptr;
+  unsigned long param;
+
+  if (strcmp(arg, "row") == 0) {
+    return ems_set_lock_granularity(LOCK_PER_ROW, 0);
+  }
+  if (strncmp(arg, "stripe:", 7) == 0) {
+    param = strtoul(arg + 7, &endptr, 10);
+    return *endptr != '\0' || ems_set_lock_granularity(LOCK_PER_STRIPE, param);
+  }
+  if (strncmp(arg, "hash:", 5) == 0) {
+    param = strtoul(arg + 5, &endptr, 10);
+    return *endptr != '\0' || ems_set_lock_granularity(LOCK_HASHED, param);
+  }
+  return 1;
+}
+
+static double elapsed_ms(const struct timespec* start, const struct timespec* end) {
+  return (double)(end->tv_sec - start->tv_sec) * 1e3 + (double)(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/// Prints the -C report: the most contended events and seat locks, and the output writer lock.
+/// @param title What ran, a job or the pool.
+/// @param writer_locks Contention of the output writer lock.
+static void report_lock_contention(const char* title, const struct LockProfile* writer_locks) {
+  struct OutputBuffer out = {NULL, 0, 0};
+  int failed = outbuf_append(&out, "Lock contention in ", strlen("Lock contention in ")) ||
+               outbuf_append(&out, title, strlen(title)) || outbuf_append(&out, ":\n", 2) ||
+               ems_lock_report(&out, LOCK_REPORT_TOP) || lock_profile_format(&out, "output writer", writer_locks);
+
+  // One write, so that reports of different job processes do not interleave
+  fflush(stdout);
+  if (failed || outbuf_flush(&out, STDOUT_FILENO) != 0) {
+    fprintf(stderr, "Failed to write the lock contention report\n");
+  }
+  outbuf_free(&out);
+}
+
+/// Accounts for a command that took from begin to finish.
+static void record_command(ThreadArgs* cmdArgs, enum Command command, const struct timespec* begin,
+                           const struct timespec* finish) {
+  double ms = elapsed_ms(begin, finish);
+  cmdArgs->executed++;
+  metrics_record_command(command, (uint64_t)(ms * 1e6));
+  if (command == CMD_WAIT) {
+    return;
+  }
+
+  cmdArgs->busy_ms += ms;
+  if (stats_fd >= 0 && latency_record(&cmdArgs->latencies, ms * 1000.0) != 0) {
+    fprintf(stderr, "Memory allocation error\n");
+  }
+}
+
+/// Writes the -S summary of the commands run by a set of threads and frees their samples.
+static void report_latencies(const char* name, ThreadArgs* args, int num_threads, double wall_ms) {
+  struct LatencySamples all = {NULL, 0, 0};
+  for (int i = 0; i < num_threads; i++) {
+    if (latency_merge(&all, &args[i].latencies) != 0) {
+      fprintf(stderr, "Memory allocation error\n");
+    }
+    latency_free(&args[i].latencies);
+  }
+  if (stats_write(stats_fd, name, num_threads, wall_ms, &all) != 0) {
+    fprintf(stderr, "Failed to write the stats of %s\n", name);
+  }
+  latency_free(&all);
+}
+
+static void execute_instruction(ThreadArgs* cmdArgs, size_t curCmd) {
+  const struct Program* program = cmdArgs->program;
+  const struct Instruction* instruction = &program->instructions[curCmd];
+  size_t xs[MAX_BATCH_SEATS], ys[MAX_BATCH_SEATS], sizes[MAX_BATCH_SIZE];
+  int results[MAX_BATCH_SIZE];
+  // SHOW and LIST output is handed to the writer in parts as it is formatted
+  struct WriterPart part = {cmdArgs->writer, curCmd};
+  struct OutputSink sink = {writer_flush_part, &part};
+
+  fflush(stdout);
+
+  switch (instruction->command) {
+    case CMD_CREATE:
+      if (ems_create(instruction->event_id, instruction->args[0], instruction->args[1])) {
+        fprintf(stderr, "Failed to create event\n");
+      }
+      break;
+
+    case CMD_RESERVE:
+      program_seats(program, instruction, xs, ys);
+      if (instruction->args[0] <= 1) {
+        if (ems_reserve(instruction->event_id, instruction->num_seats, xs, ys)) {
+          fprintf(stderr, "Failed to reserve seats\n");
         }
-        
         break;
+      }
+
+      // Every reservation of the batch fails if its event does not exist
+      program_sizes(program, instruction, sizes);
+      ems_reserve_batch(instruction->event_id, instruction->args[0], sizes, xs, ys, results);
+      for (size_t i = 0; i < instruction->args[0]; i++) {
+        if (results[i] != 0) {
+          fprintf(stderr, "Failed to reserve seats\n");
+        }
+      }
+      break;
+
+    case CMD_SHOW:
+      // A render that fails partway drops its unflushed part, the parts
+      // already flushed are written anyway, as a truncated grid
+      if (ems_show(instruction->event_id, &cmdArgs->output, &sink)) {
+        fprintf(stderr, "Failed to show event\n");
+        cmdArgs->output.len = 0;
+      }
+      writer_submit(cmdArgs->writer, curCmd, &cmdArgs->output);
+      break;
+
+    case CMD_LIST_EVENTS:
+      if (ems_list_events(&cmdArgs->output, &sink)) {
+        fprintf(stderr, "Failed to list events\n");
+        cmdArgs->output.len = 0;
+      }
+      writer_submit(cmdArgs->writer, curCmd, &cmdArgs->output);
+      break;
+
+    case CMD_WAIT:
+      // Only queued for the threads it applies to, see fill_queue
+      if (instruction->args[0] > 0){
+        printf("Waiting...\n");
+        ems_wait(instruction->args[0]);
+      }
+      break;
+
+    case CMD_HELP:
+      printf(
+        "Available commands:\n"
+        "  CREATE <event_id> <num_rows> <num_columns>\n"
+        "  RESERVE <event_id> [(<x1>,<y1>) (<x2>,<y2>) ...] [...] ...\n"
+        "  SHOW <event_id>\n"
+        "  LIST\n"
+        "  WAIT <delay_ms> [thread_id]\n"
+        "  BARRIER\n"
+        "  HELP\n");
+      break;
+
+    case CMD_BARRIER:
+    case CMD_INVALID:
+    case CMD_EMPTY:
+    case EOC:
+      break;
+  }
+}
+
+/// Queues this thread's share of the instructions in [start, end), which holds no BARRIER.
+/// Commands are dealt round-robin, WAITs go to every thread they apply to and stay pinned there.
+/// With -d, only the commands that depend on no other are queued, the rest are queued as they
+/// become ready, see release_successors.
+static int fill_queue(ThreadArgs* cmdArgs, size_t start, size_t end) {
+  const struct Program* program = cmdArgs->program;
+  struct DependencyRun* run = cmdArgs->run;
+  struct WorkQueue* queue = &cmdArgs->queues[cmdArgs->thread_id];
+  size_t num_waits = 0;
 
-      case CMD_RESERVE:
-        num_coords = parse_reserve(fd_in, MAX_RESERVATION_SIZE, &event_id, xs, ys);
+  workqueue_reset(queue);
+  for (size_t i = start; i < end; i++) {
+    const struct Instruction* instruction = &program->instructions[i];
+    int pushed = 0;
 
-        if (num_coords == 0) {
-          fprintf(stderr, "Failed Reserve. Invalid command. See HELP for usage\n");
+    if (instruction->command == CMD_WAIT) {
+      unsigned int target_thread_id = instruction->args[1];
+      if (target_thread_id == 0 || (int)target_thread_id == cmdArgs->thread_id + 1) {
+        pushed = workqueue_push(queue, i, 1);
+      }
+      num_waits++;
+    } else if (i % (size_t)cmdArgs->total_threads == (size_t)cmdArgs->thread_id &&
+               (run == NULL || atomic_load_explicit(&run->graph.pending[i], memory_order_relaxed) == 0)) {
+      pushed = workqueue_push(queue, i, 0);
+    }
+
+    if (pushed != 0) {
+      fprintf(stderr, "Memory allocation error\n");
+      return 1;
+    }
+  }
+
+  // Read by every thread only after the barrier that starts the phase
+  if (run != NULL && cmdArgs->thread_id == 0) {
+    atomic_store(&run->remaining, end - start - num_waits);
+  }
+  return 0;
+}
+
+/// Takes the next instruction from this thread's queue, or steals one from another thread.
+/// @return 1 if an instruction was found, 0 once every queue is empty.
+static int next_instruction(ThreadArgs* cmdArgs, size_t* curCmd) {
+  if (workqueue_pop(&cmdArgs->queues[cmdArgs->thread_id], curCmd)) {
+    return 1;
+  }
+
+  for (int i = 1; i < cmdArgs->total_threads; i++) {
+    int victim = (cmdArgs->thread_id + i) % cmdArgs->total_threads;
+    if (workqueue_steal(&cmdArgs->queues[victim], curCmd)) {
+      cmdArgs->stolen++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Queues the instructions that were only waiting for the one just run on this thread.
+/// @param cmdArgs Arguments of the thread that ran the instruction.
+/// @param curCmd Instruction that was run, any command but WAIT.
+static void release_successors(ThreadArgs* cmdArgs, size_t curCmd) {
+  struct DependencyRun* run = cmdArgs->run;
+  const struct DependencyGraph* graph = &run->graph;
+  int pushed = 0;
+
+  for (size_t i = graph->first_successor[curCmd]; i < graph->first_successor[curCmd + 1]; i++) {
+    size_t successor = graph->successors[i];
+    // acq_rel: whoever queues the successor sees what each of its predecessors did
+    if (atomic_fetch_sub_explicit(&graph->pending[successor], 1, memory_order_acq_rel) == 1) {
+      if (workqueue_push(&cmdArgs->queues[cmdArgs->thread_id], successor, 0) != 0) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+      }
+      pushed = 1;
+    }
+  }
+
+  if (pushed) {
+    atomic_fetch_add(&run->queued, 1);
+  }
+  size_t remaining = atomic_fetch_sub(&run->remaining, 1) - 1;
+
+  // Pairs with the idle count in wait_for_ready: either the sleeper sees the
+  // new work or the end of the phase, or it is seen here and woken up
+  if ((pushed || remaining == 0) && atomic_load(&run->idle) > 0) {
+    pthread_mutex_lock(&run->lock);
+    pthread_cond_broadcast(&run->ready);
+    pthread_mutex_unlock(&run->lock);
+  }
+}
+
+/// Sleeps until more instructions are queued or the phase is over.
+/// @param run Progress of the job.
+/// @param seen Value of run->queued before the queues were last found empty.
+/// @return 1 if instructions may have been queued since, 0 once the phase is over.
+static int wait_for_ready(struct DependencyRun* run, size_t seen) {
+  if (atomic_load(&run->remaining) == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&run->lock);
+  atomic_fetch_add(&run->idle, 1);
+  while (atomic_load(&run->queued) == seen && atomic_load(&run->remaining) > 0) {
+    pthread_cond_wait(&run->ready, &run->lock);
+  }
+  atomic_fetch_sub(&run->idle, 1);
+  pthread_mutex_unlock(&run->lock);
+  return atomic_load(&run->remaining) > 0;
+}
+
+void* handle_commands (void * args){
+  ThreadArgs *cmdArgs = (ThreadArgs *)args;
+  const struct Program* program = cmdArgs->program;
+  struct DependencyRun* run = cmdArgs->run;
+  size_t start = 0;
+
+  // Instructions are run in phases separated by BARRIERs. Without -d nothing
+  // is queued while a phase runs, so once every queue is empty the phase is
+  // over. With -d, the phase is over once all of its instructions have run.
+  while (start < program->count) {
+    size_t end = start;
+    while (end < program->count && program->instructions[end].command != CMD_BARRIER) {
+      end++;
+    }
+
+    if (fill_queue(cmdArgs, start, end) != 0) {
+      exit(1);
+    }
+    // no thread may steal before every queue of the phase is filled
+    pthread_barrier_wait(cmdArgs->barrier);
+
+    size_t curCmd;
+    for (;;) {
+      size_t seen = run != NULL ? atomic_load(&run->queued) : 0;
+      if (!next_instruction(cmdArgs, &curCmd)) {
+        if (run != NULL && wait_for_ready(run, seen)) {
           continue;
         }
-        if (curCmd%total_threads==thread_id && curCmd>=start_line){
-          if (ems_reserve(event_id, num_coords, xs, ys)) {
-            fprintf(stderr, "Failed to reserve seats\n");
-          }
-        }
-        
         break;
+      }
+
+      enum Command command = program->instructions[curCmd].command;
+      struct timespec begin, finish;
+      clock_gettime(CLOCK_MONOTONIC, &begin);
+      execute_instruction(cmdArgs, curCmd);
+      clock_gettime(CLOCK_MONOTONIC, &finish);
+      record_command(cmdArgs, command, &begin, &finish);
+
+      if (run != NULL && command != CMD_WAIT) {
+        release_successors(cmdArgs, curCmd);
+      }
+    }
+
+    // BARRIER: nobody starts the next phase before this one is done
+    pthread_barrier_wait(cmdArgs->barrier);
+    start = end + 1;
+  }
+  return NULL;
+}
+
+/// Tells whether a job file was compiled by jobsc.
+static int is_compiled_job(const char *name) {
+  size_t len = strlen(name);
+  return len > 6 && strcmp(name + len - 6, ".jobsb") == 0;
+}
 
-      case CMD_SHOW:
+/// Tells whether a directory entry is a job file, in text or compiled.
+static int is_job_file(const char *name) {
+  size_t len = strlen(name);
+  return (len > 5 && strcmp(name + len - 5, ".jobs") == 0) || is_compiled_job(name);
+}
+
+/// Tells whether a compiled job file has its text job file next to it.
+/// Both would write the same .out file, so only the text one is run.
+static int has_text_job(const char *dir_str, const char *name) {
+  char path[PATH_MAX];
+  struct stat st;
+  // Same name without the trailing b of .jobsb
+  int len = snprintf(path, sizeof(path), "%s%.*s", dir_str, (int)strlen(name) - 1, name);
+  return len > 0 && len < (int)sizeof(path) && stat(path, &st) == 0;
+}
+
+/// Parses a job file and creates its output file, next to it with the .out extension.
+/// @param dir_str Directory of the job file, ending with a slash.
+/// @param job_name Name of the job file, ending with .jobs or, if compiled, .jobsb.
+/// @param program Set to the parsed program, to be freed with program_free.
+/// @param fd_out Set to the descriptor of the output file.
+/// @return 0 if the job was opened successfully, 1 otherwise.
+static int open_job(const char *dir_str, const char *job_name, struct Program **program, int *fd_out) {
+  size_t dir_length = strlen(dir_str), name_length = strlen(job_name);
+  char *file_path = malloc(dir_length + name_length + 1);
+  if (file_path == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    return 1;
+  }
+  strcpy(file_path, dir_str);
+  strcat(file_path, job_name);
 
-        
-        if (parse_show(fd_in, &event_id) != 0) {
-          fprintf(stderr, "Failed Show. Invalid command. See HELP for usage\n");
+  int fd_in = open(file_path, O_RDONLY);
+  if (fd_in < 0){
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    free(file_path);
+    return 1;
+  }
+
+  *program = NULL;
+  uint64_t parse_start = metrics_enabled() ? metrics_now_ns() : 0;
+  struct stat st;
+  int compiled = is_compiled_job(job_name);
+  if (compiled) {
+    // Decoded straight from the page cache, without going through the parser
+    if (fstat(fd_in, &st) == 0 && st.st_size > 0 && (uintmax_t)st.st_size <= SIZE_MAX) {
+      size_t size = (size_t)st.st_size;
+      void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd_in, 0);
+      if (data != MAP_FAILED) {
+        *program = jobsb_decode(data, size);
+        munmap(data, size);
+      }
+    }
+    close(fd_in);
+    fd_in = -1;
+  } else if (parse_threads > 1 && fstat(fd_in, &st) == 0 && st.st_size > 0 && (uintmax_t)st.st_size <= SIZE_MAX) {
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd_in, 0);
+    if (data != MAP_FAILED) {
+      *program = program_parse_chunked(data, size, parse_threads);
+      munmap(data, size);
+      close(fd_in);
+      fd_in = -1;
+    }
+  }
+  if (fd_in >= 0) {
+    // Small or unmappable files are read through the parser's own buffer
+    *program = program_parse(fd_in);
+    parser_release(fd_in);
+    close(fd_in);
+  }
+  if (metrics_enabled()) {
+    metrics_add_time(TIMER_PARSE, metrics_now_ns() - parse_start);
+  }
+  if (*program == NULL){
+    fprintf(stderr, "Failed to parse %s\n", file_path);
+    free(file_path);
+    return 1;
+  }
+
+  // same path, with .out instead of .jobs or .jobsb
+  strcpy(file_path + dir_length + name_length - (compiled ? 6 : 5), ".out");
+  *fd_out = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (*fd_out < 0){
+    fprintf(stderr, "Failed to open file .out. Error: %s\n", strerror(errno));
+    program_free(*program);
+    free(file_path);
+    return 1;
+  }
+  free(file_path);
+  return 0;
+}
+
+/// Runs one job file with a pool of max_threads threads.
+/// @return 0 if the job ran, 1 if it could not be started.
+static int run_job(const char *dir_str, const char *job_name, int max_threads) {
+  pthread_t tids [max_threads];
+  struct Program* program;
+  int fd_out;
+  int failed = 1;
+
+  if (open_job(dir_str, job_name, &program, &fd_out) != 0) {
+    return 1;
+  }
+
+  // Set up one by one, whatever was set up is freed at cleanup
+  int barrier_ready = 0, num_queues = 0, graph_ready = 0;
+  pthread_barrier_t barrier;
+  struct DependencyRun run;
+  struct OrderedWriter writer;
+
+  ThreadArgs *args = (ThreadArgs*) malloc(sizeof(ThreadArgs) * (size_t)max_threads); 
+  struct WorkQueue *queues = (struct WorkQueue*) malloc(sizeof(struct WorkQueue) * (size_t)max_threads);
+  if (args == NULL || queues == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    goto cleanup;
+  }
+
+  if (pthread_barrier_init(&barrier, NULL, (unsigned int)max_threads) != 0){
+    fprintf(stderr, "Failed to initialize barrier\n");
+    goto cleanup;
+  }
+  barrier_ready = 1;
+
+  for (; num_queues < max_threads; num_queues++){
+    if (workqueue_init(&queues[num_queues]) != 0){
+      fprintf(stderr, "Failed to initialize work queue\n");
+      goto cleanup;
+    }
+  }
+
+  if (dependency_order){
+    if (depgraph_build(&run.graph, program) != 0){
+      fprintf(stderr, "Failed to order the commands of %s\n", job_name);
+      goto cleanup;
+    }
+    atomic_init(&run.remaining, 0);
+    atomic_init(&run.queued, 0);
+    atomic_init(&run.idle, 0);
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.ready, NULL);
+    graph_ready = 1;
+  }
+
+  if (writer_start(&writer, program, fd_out) != 0){
+    fprintf(stderr, "Failed to start output writer\n");
+    goto cleanup;
+  }
+
+  struct timespec job_start, job_end;
+  clock_gettime(CLOCK_MONOTONIC, &job_start);
+
+  // create all threads, they live until the end of the job
+  for (int num_threads = 0; num_threads < max_threads; num_threads++){
+    args[num_threads].thread_id = num_threads;
+    args[num_threads].program = program;
+    args[num_threads].total_threads = max_threads;
+    args[num_threads].writer = &writer;
+    args[num_threads].output = (struct OutputBuffer){NULL, 0, 0};
+    args[num_threads].barrier = &barrier;
+    args[num_threads].queues = queues;
+    args[num_threads].run = dependency_order ? &run : NULL;
+    args[num_threads].executed = 0;
+    args[num_threads].stolen = 0;
+    args[num_threads].busy_ms = 0;
+    args[num_threads].latencies = (struct LatencySamples){NULL, 0, 0};
+    if (pthread_create(&tids[num_threads],NULL, handle_commands, (void *)&args[num_threads]) != 0){
+      // the barrier counts max_threads participants, the others could never cross it
+      fprintf(stderr, "error creating thread.\n");
+      exit(1);
+    }
+  }
+  //wait for all threads
+  for (int i = 0; i < max_threads; ++i) {
+    pthread_join(tids[i], NULL);
+    outbuf_free(&args[i].output);
+  }
+  if (writer_finish(&writer) != 0){
+    fprintf(stderr, "Failed to write the output of %s\n", job_name);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &job_end);
+  if (lock_profiling_enabled()){
+    report_lock_contention(job_name, &writer.lock_profile);
+  }
+
+  double wall_ms = elapsed_ms(&job_start, &job_end);
+  if (stats_fd >= 0){
+    report_latencies(job_name, args, max_threads, wall_ms);
+  }
+  if (print_utilization){
+    for (int i = 0; i < max_threads; i++){
+      printf("%s thread %d: %zu commands (%zu stolen), busy %.1f%% of %.1f ms\n", job_name,
+             i + 1, args[i].executed, args[i].stolen, wall_ms > 0 ? 100.0 * args[i].busy_ms / wall_ms : 0.0, wall_ms);
+    }
+  }
+
+  failed = 0;
+
+cleanup:
+  for (int i = 0; i < num_queues; i++){
+    workqueue_destroy(&queues[i]);
+  }
+  free(queues);
+  free(args);
+  if (barrier_ready){
+    pthread_barrier_destroy(&barrier);
+  }
+  if (graph_ready){
+    pthread_cond_destroy(&run.ready);
+    pthread_mutex_destroy(&run.lock);
+    depgraph_free(&run.graph);
+  }
+
+  program_free(program);
+  close(fd_out);
+  return failed;
+}
+
+
+/// Orders job files largest first.
+static int compare_job_size(const void *a, const void *b) {
+  const struct JobFile *ja = a, *jb = b;
+  return (ja->size < jb->size) - (ja->size > jb->size);
+}
+
+/// Lists the job files of a directory, in readdir order.
+/// @param dirp Open directory.
+/// @param dir_str Path of the directory, used to stat the files.
+/// @param jobs Set to the array of job files, to be freed by the caller.
+/// @param count Set to the number of job files found.
+/// @return 0 if the directory was listed successfully, 1 otherwise.
+static int list_job_files(DIR *dirp, const char *dir_str, struct JobFile **jobs, size_t *count) {
+  struct JobFile *files = NULL;
+  size_t capacity = 0;
+  struct dirent *file_searcher;
+  char path[PATH_MAX];
+
+  *count = 0;
+  while ((file_searcher = readdir(dirp)) != NULL) {
+    if (!is_job_file(file_searcher->d_name) ||
+        (is_compiled_job(file_searcher->d_name) && has_text_job(dir_str, file_searcher->d_name))) {
+      continue;
+    }
+    if (strlen(file_searcher->d_name) >= sizeof(files->request.name)) {
+      fprintf(stderr, "Job file name too long: %s\n", file_searcher->d_name);
+      continue;
+    }
+
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      struct JobFile *grown = realloc(files, capacity * sizeof(struct JobFile));
+      if (grown == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        free(files);
+        return 1;
+      }
+      files = grown;
+    }
+
+    struct JobFile *file = &files[*count];
+    memset(&file->request, 0, sizeof(file->request));
+    strcpy(file->request.name, file_searcher->d_name);
+
+    struct stat st;
+    file->size = 0;
+    if (largest_first && snprintf(path, sizeof(path), "%s%s", dir_str, file->request.name) < (int)sizeof(path) &&
+        stat(path, &st) == 0) {
+      file->size = st.st_size;
+    }
+    (*count)++;
+  }
+  *jobs = files;
+  return 0;
+}
+
+/// Body of the job processes: runs the jobs whose names arrive through the
+/// queue until the parent closes it, then reports its busy time.
+static void job_worker(int queue_fd, int report_fd, const char *dir_str, int max_threads,
+                       const struct timespec *dispatch_start) {
+  struct JobRequest request;
+  struct WorkerReport report = {getpid(), 0, 0, 0};
+  struct timespec begin, finish = *dispatch_start;
+  ssize_t bytes_read;
+
+  // Requests are written whole and are smaller than PIPE_BUF, so every read
+  // gets exactly one, even with all the workers reading from the same pipe.
+  while ((bytes_read = read(queue_fd, &request, sizeof(request))) != 0) {
+    if (bytes_read < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "read error: %s\n", strerror(errno));
+      break;
+    }
+    if ((size_t)bytes_read != sizeof(request)) {
+      fprintf(stderr, "Malformed job request\n");
+      break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (run_job(dir_str, request.name, max_threads) != 0) {
+      fprintf(stderr, "Failed to run %s\n", request.name);
+    }
+    // Each job gets events of its own, as when every job had a process of its own
+    if (ems_reset() != 0) {
+      fprintf(stderr, "Failed to reset EMS state\n");
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    report.jobs++;
+    report.busy_ms += elapsed_ms(&begin, &finish);
+  }
+  report.alive_ms = elapsed_ms(dispatch_start, &finish);
+
+  // Smaller than PIPE_BUF, so reports from different workers never interleave
+  write_all(report_fd, (const char *)&report, sizeof(report));
+  close(report_fd);
+  close(queue_fd);
+  exit(0);
+}
+
+static void timespec_add_ms(struct timespec* ts, unsigned int ms) {
+  ts->tv_sec += (time_t)(ms / 1000);
+  ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static int timespec_before(const struct timespec* a, const struct timespec* b) {
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/// Points the job's phase at the instructions from its cursor to the next BARRIER.
+static void pool_job_start_phase(struct PoolJob* job) {
+  const struct Program* program = job->program;
+  job->phase_end = job->next;
+  while (job->phase_end < program->count && program->instructions[job->phase_end].command != CMD_BARRIER) {
+    job->phase_end++;
+  }
+}
+
+/// Opens a job claimed by the calling thread. Called with the pool lock released.
+/// @return 0 if the job can run, 1 if it failed to start.
+static int pool_job_load(struct JobPool* pool, struct PoolJob* job) {
+  if (open_job(pool->dir_str, job->name, &job->program, &job->fd_out) != 0) {
+    return 1;
+  }
+  if (writer_start(&job->writer, job->program, job->fd_out) != 0) {
+    fprintf(stderr, "Failed to start output writer\n");
+    program_free(job->program);
+    close(job->fd_out);
+    return 1;
+  }
+  return 0;
+}
+
+/// Flushes and frees a job once all its instructions are done. Called with the pool lock released.
+static void pool_job_finish(struct JobPool* pool, struct PoolJob* job) {
+  if (writer_finish(&job->writer) != 0) {
+    fprintf(stderr, "Failed to write the output of %s\n", job->name);
+  }
+  lock_profile_add(&pool->writer_locks, &job->writer.lock_profile);
+  program_free(job->program);
+  close(job->fd_out);
+}
+
+/// Body of the pool threads with -P: runs instructions of any job until all are done.
+static void* pool_commands(void* args) {
+  ThreadArgs* cmdArgs = (ThreadArgs*)args;
+  struct JobPool* pool = cmdArgs->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->first_active < pool->count) {
+    struct timespec now, wake_at = {0, 0};
+    int must_wake = 0;
+    struct PoolJob* job = NULL;
+    enum JobState claimed = JOB_PENDING;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t i = pool->first_active; i < pool->count && job == NULL; i++) {
+      struct PoolJob* candidate = &pool->jobs[i];
+
+      if (candidate->state == JOB_PENDING) {
+        candidate->state = claimed = JOB_LOADING;
+        job = candidate;
+      } else if (candidate->state == JOB_RUNNING) {
+        if (candidate->next == candidate->phase_end) {
+          // Nothing more to dispatch before the in-flight instructions are done
+          if (candidate->in_flight > 0) continue;
+          if (candidate->phase_end == candidate->program->count) {
+            candidate->state = claimed = JOB_FINISHING;
+            job = candidate;
+            continue;
+          }
+          // BARRIER: the previous phase is done, move on to the next
+          candidate->next = candidate->phase_end + 1;
+          pool_job_start_phase(candidate);
+          i--;  // Look at it again
           continue;
         }
-        if (curCmd%total_threads==thread_id && curCmd>=start_line){
-          pthread_mutex_lock(&writing_locker);
-          if (ems_show(event_id, fd_out)) {
-            fprintf(stderr, "Failed to show event\n");
+        if (timespec_before(&now, &candidate->resume_at)) {
+          if (!must_wake || timespec_before(&candidate->resume_at, &wake_at)) {
+            wake_at = candidate->resume_at;
+            must_wake = 1;
           }
-          pthread_mutex_unlock(&writing_locker);
+          continue;
         }
-        break;
 
-      case CMD_LIST_EVENTS:
-        if (curCmd%total_threads==thread_id && curCmd>=start_line){
-          pthread_mutex_lock(&writing_locker);
-          if (ems_list_events(fd_out)) {
-            fprintf(stderr, "Failed to list events\n");
+        const struct Instruction* instruction = &candidate->program->instructions[candidate->next];
+        if (instruction->command == CMD_WAIT) {
+          // The job's threads are not fixed, so a WAIT suspends the whole job
+          candidate->next++;
+          if (instruction->args[0] > 0) {
+            printf("Waiting...\n");
+            candidate->resume_at = now;
+            timespec_add_ms(&candidate->resume_at, instruction->args[0]);
           }
-          pthread_mutex_unlock(&writing_locker);
+          i--;
+          continue;
         }
-        break;
+        claimed = JOB_RUNNING;
+        job = candidate;
+      }
+    }
 
-      case CMD_WAIT:
-          unsigned int target_thread_id;
-          int has_thread_id = parse_wait(fd_in, &delay, &target_thread_id);
-          if (curCmd>=start_line && parse_wait(fd_in, &delay, &target_thread_id)>0){
-              if (has_thread_id == -1) {  
-              fprintf(stderr, "Invalid command. See HELP for usage\n");
-            } else if (has_thread_id && (int)target_thread_id == thread_id+1 && delay > 0){
-              printf("Waiting...\n");
-              ems_wait(delay);
-            } else if (!has_thread_id && delay > 0){
-              printf("Waiting...\n");
-              ems_wait(delay);  
-            }
-          }
-          
-          break;
+    if (job == NULL) {
+      // Every job is loading, blocked at a BARRIER or waiting
+      if (must_wake) {
+        pthread_cond_timedwait(&pool->changed, &pool->lock, &wake_at);
+      } else {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+      }
+      continue;
+    }
 
-      case CMD_INVALID:
-        if (curCmd>=start_line){
-          fprintf(stderr, "Invalido. Invalid command. See HELP for usage\n");
-        }
-        break;
+    if (claimed == JOB_LOADING) {
+      pthread_mutex_unlock(&pool->lock);
+      int failed = pool_job_load(pool, job);
+      pthread_mutex_lock(&pool->lock);
+      if (failed) {
+        fprintf(stderr, "Failed to run %s\n", job->name);
+        job->state = JOB_DONE;
+      } else {
+        job->state = JOB_RUNNING;
+        pool_job_start_phase(job);
+      }
+    } else if (claimed == JOB_FINISHING) {
+      pthread_mutex_unlock(&pool->lock);
+      pool_job_finish(pool, job);
+      pthread_mutex_lock(&pool->lock);
+      job->state = JOB_DONE;
+    } else {
+      size_t curCmd = job->next++;
+      job->in_flight++;
+      pthread_mutex_unlock(&pool->lock);
 
-      case CMD_HELP:
-        if (curCmd>=start_line){
-          printf(
-            "Available commands:\n"
-            "  CREATE <event_id> <num_rows> <num_columns>\n"
-            "  RESERVE <event_id> [(<x1>,<y1>) (<x2>,<y2>) ...]\n"
-            "  SHOW <event_id>\n"
-            "  LIST\n"
-            "  WAIT <delay_ms> [thread_id]\n"  // thread_id is not implemented
-            "  BARRIER\n"                      // Not implemented
-            "  HELP\n");
-        }
-        break;
+      struct timespec begin, finish;
+      cmdArgs->program = job->program;
+      cmdArgs->writer = &job->writer;
+      clock_gettime(CLOCK_MONOTONIC, &begin);
+      execute_instruction(cmdArgs, curCmd);
+      clock_gettime(CLOCK_MONOTONIC, &finish);
+      record_command(cmdArgs, job->program->instructions[curCmd].command, &begin, &finish);
 
-      case CMD_BARRIER:
-        if (curCmd>=start_line){
-          struct HandlerResult *state_curCmd = malloc(sizeof(struct HandlerResult));
-          state_curCmd->barrier_state = BARRIER_ON;
-          state_curCmd->curCmd = curCmd+1;
-          pthread_exit(state_curCmd);
-          free(state_curCmd);
-        }
-        break;
-      case CMD_EMPTY:
-        break;
+      pthread_mutex_lock(&pool->lock);
+      if (--job->in_flight > 0) continue;
+    }
 
-      case EOC:
-        break;
+    // A job was started, finished or may have reached a BARRIER
+    while (pool->first_active < pool->count && pool->jobs[pool->first_active].state == JOB_DONE) {
+      pool->first_active++;
     }
-    curCmd++;
+    pthread_cond_broadcast(&pool->changed);
   }
+  pthread_mutex_unlock(&pool->lock);
   return NULL;
 }
 
+/// Runs all the jobs in this process, on one pool of num_threads threads.
+/// @return 0 if the pool ran, 1 if it could not be started.
+static int run_job_pool(const char *dir_str, const struct JobFile *files, size_t count, int num_threads) {
+  struct JobPool pool;
+  pthread_condattr_t cond_attr;
+  pthread_t tids[num_threads];
+
+  pool.jobs = calloc(count, sizeof(struct PoolJob));
+  ThreadArgs *args = calloc((size_t)num_threads, sizeof(ThreadArgs));
+  if ((pool.jobs == NULL && count > 0) || args == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    free(pool.jobs);
+    free(args);
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    pool.jobs[i].name = files[i].request.name;
+    pool.jobs[i].state = JOB_PENDING;
+  }
+  pool.count = count;
+  pool.first_active = 0;
+  pool.dir_str = dir_str;
+  memset(&pool.writer_locks, 0, sizeof(pool.writer_locks));
+  pthread_mutex_init(&pool.lock, NULL);
+  // WAIT deadlines are taken from the monotonic clock
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pool.changed, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  struct timespec pool_start, pool_end;
+  clock_gettime(CLOCK_MONOTONIC, &pool_start);
+
+  // The pool threads inherit SIGUSR1 blocked, this thread takes it with sigtimedwait
+  sigset_t metrics_signal, old_mask;
+  sigemptyset(&metrics_signal);
+  sigaddset(&metrics_signal, SIGUSR1);
+  if (metrics_fd >= 0) {
+    pthread_sigmask(SIG_BLOCK, &metrics_signal, &old_mask);
+  }
+
+  int started = 0;
+  for (; started < num_threads; started++) {
+    args[started].thread_id = started;
+    args[started].total_threads = num_threads;
+    args[started].pool = &pool;
+    if (pthread_create(&tids[started], NULL, pool_commands, &args[started]) != 0) {
+      // the others can still run every job
+      fprintf(stderr, "error creating thread.\n");
+      break;
+    }
+  }
+  if (metrics_fd >= 0 && started > 0) {
+    const struct timespec poll_interval = {0, 100 * 1000000};
+    for (;;) {
+      pthread_mutex_lock(&pool.lock);
+      int done = pool.first_active == pool.count;
+      pthread_mutex_unlock(&pool.lock);
+      if (done) break;
+
+      if (sigtimedwait(&metrics_signal, NULL, &poll_interval) == SIGUSR1 && metrics_dump(metrics_fd) != 0) {
+        fprintf(stderr, "Failed to write the metrics\n");
+      }
+    }
+  }
+  if (metrics_fd >= 0) {
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+    outbuf_free(&args[i].output);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &pool_end);
+
+  double wall_ms = elapsed_ms(&pool_start, &pool_end);
+  if (lock_profiling_enabled()) {
+    report_lock_contention("the pool", &pool.writer_locks);
+  }
+  if (stats_fd >= 0) {
+    report_latencies("pool", args, started, wall_ms);
+  }
+  if (print_utilization) {
+    for (int i = 0; i < started; i++) {
+      printf("Pool thread %d: %zu commands, busy %.1f%% of %.1f ms\n", i + 1, args[i].executed,
+             wall_ms > 0 ? 100.0 * args[i].busy_ms / wall_ms : 0.0, wall_ms);
+    }
+  }
+
+  pthread_cond_destroy(&pool.changed);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.jobs);
+  free(args);
+  return started > 0 ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
   unsigned int state_access_delay_ms = STATE_ACCESS_DELAY_MS;
   char *dir_str;
   int max_proc, max_threads;
   
   DIR * dirp;
-  struct dirent * file_searcher;
-  //int fd;
 
-  //Get all arguments (directory, max_proc, max_thread, delay)
+  //Get all options, then the arguments (directory, max_proc, max_thread, delay)
+  int opt;
+  while ((opt = getopt(argc, argv, "usPdc:S:M:Col:m:")) != -1) {
+    switch (opt) {
+      case 'u':
+        print_utilization = 1;
+        break;
+      case 's':
+        largest_first = 1;
+        break;
+      case 'P':
+        single_process = 1;
+        break;
+      case 'd':
+        dependency_order = 1;
+        break;
+      case 'c': {
+        char *endptr;
+        long threads = strtol(optarg, &endptr, 10);
+        if (*endptr != '\0' || threads <= 0 || threads > MAX_PARSE_THREADS) {
+          fprintf(stderr, "Invalid number of parsing threads\n");
+          return 1;
+        }
+        parse_threads = (int)threads;
+        break;
+      }
+      case 'C':
+        lock_profiling_enable();
+        break;
+      case 'M':
+        // Written by the parent only, at exit and on SIGUSR1
+        metrics_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (metrics_fd < 0) {
+          fprintf(stderr, "Failed to open %s. Error: %s\n", optarg, strerror(errno));
+          return 1;
+        }
+        if (metrics_init() != 0) {
+          fprintf(stderr, "Failed to set up the metrics\n");
+          return 1;
+        }
+        break;
+      case 'S':
+        // Appended to by every job process, one whole line per write
+        stats_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (stats_fd < 0) {
+          fprintf(stderr, "Failed to open %s. Error: %s\n", optarg, strerror(errno));
+          return 1;
+        }
+        break;
+      case 'o':
+        ems_set_optimistic_reservations(1);
+        break;
+      case 'l':
+        if (parse_lock_granularity(optarg) != 0) {
+          fprintf(stderr, "Invalid lock granularity\n");
+          return 1;
+        }
+        break;
+      case 'm': {
+        char *endptr;
+        unsigned long shared_mib = strtoul(optarg, &endptr, 10);
+        if (*endptr != '\0' || shared_mib == 0 || shared_mib > SIZE_MAX / (1024 * 1024) ||
+            ems_set_shared_memory(shared_mib * 1024 * 1024) != 0) {
+          fprintf(stderr, "Invalid shared memory size\n");
+          return 1;
+        }
+        break;
+      }
+      default:
+        fprintf(stderr, USAGE);
+        return 1;
+    }
+  }
+  if (dependency_order && single_process) {
+    // The jobs of a pool share their events, ordering each job on its own would not be enough
+    fprintf(stderr, "-d cannot be used with -P\n");
+    return 1;
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 4) {
+    fprintf(stderr, USAGE);
+    return 1;
+  }
+
   if (argc > 4) {
     char *endptr;
     unsigned long int delay = strtoul(argv[4], &endptr, 10);
@@ -182,6 +1142,15 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Failed to initialize EMS\n");
     return 1;
   }
+  if (metrics_fd >= 0) {
+    // No SA_RESTART: the blocking calls of the parent return EINTR, which is
+    // when the metrics are written
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_metrics;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+  }
   dir_str = argv[1];
   dirp = opendir(dir_str);
   if (dirp == NULL) {
@@ -200,121 +1169,93 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  int proc_count = 0;
-  while ((file_searcher = readdir(dirp))!= NULL){
-    size_t file_name_length = strlen(file_searcher->d_name);
-
-    if (strcmp(file_searcher->d_name + strlen(file_searcher->d_name) - 5, ".jobs") == 0){
-      if (proc_count >= max_proc){
-        int status;
-        pid_t terminated_pid = wait(&status);
-        if (terminated_pid > 0){
-          printf("Child process %d terminated\n", terminated_pid);
-          proc_count--;
-        }
-      }
+  size_t job_count;
+  struct JobFile *jobs;
+  if (list_job_files(dirp, dir_str, &jobs, &job_count) != 0) {
+    closedir(dirp);
+    return 1;
+  }
+  if (largest_first && job_count > 1) {
+    // The biggest jobs start first, so none is left to run alone at the end
+    qsort(jobs, job_count, sizeof(struct JobFile), compare_job_size);
+  }
 
-      // fork, create a new process for the current file being pointed by file_searcher
-      pid_t pid = fork();
+  if (single_process) {
+    if (max_threads > INT_MAX / max_proc) {
+      fprintf(stderr, "Invalid value for maximum number of threads\n");
+      return 1;
+    }
+    int failed = run_job_pool(dir_str, jobs, job_count, max_proc * max_threads);
+    free(jobs);
+    if (metrics_fd >= 0 && metrics_dump(metrics_fd) != 0) {
+      fprintf(stderr, "Failed to write the metrics\n");
+    }
+    ems_terminate();
+    closedir(dirp);
+    return failed;
+  }
 
-      if (pid == -1){
-        fprintf(stderr, "Failed to fork\n");
-        return 1;
-      } 
-
-      else if (pid == 0){
-        pthread_t tids [max_threads];
-
-        proc_count++;
-        
-        char* file_path = malloc((strlen(dir_str)+ strlen(file_searcher->d_name)+2)*sizeof(char));
-        strcpy(file_path, dir_str);
-        strcat(file_path, file_searcher->d_name);
-
-        
-        int fd_in = open(file_path, O_RDONLY);
-        if (fd_in < 0){
-          fprintf(stderr, "open error: %s\n", strerror(errno));
-          return -1;
-        }
+  // Job files are handed out through a pipe to max_proc long-lived workers,
+  // which report their busy time through another one when they are done
+  int queue[2], reports[2];
+  if (pipe(queue) != 0 || pipe(reports) != 0) {
+    fprintf(stderr, "Failed to create job queue\n");
+    return 1;
+  }
 
-        char *file_name = strndup(file_searcher->d_name, file_name_length - 5);
-        char *extension = ".out";
-        file_name = (char *)realloc(file_name, (strlen(file_name) + strlen(extension) + 1) * sizeof(char));
-        strcat(file_name, extension);
-        if (file_name == NULL) {
-          fprintf(stderr, "Memory allocation error\n");
-          return 1;
-        }
-        char* file_out_path = (char*) malloc((strlen(dir_str)+ strlen(file_name) + 1) * sizeof(char));
-        if (file_out_path == NULL) {
-          fprintf(stderr, "Memory allocation error\n");
-          return 1;
-        }
-        strcpy(file_out_path, dir_str);
-        strcat(file_out_path, file_name);
+  struct timespec dispatch_start;
+  clock_gettime(CLOCK_MONOTONIC, &dispatch_start);
 
-        int fd_out = open(file_out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644); //trocar var p fd_out pq é um file descriptor
-        if (fd_out < 0){
-          fprintf(stderr, "Failed to open file .out. Error: %s", strerror(errno));
-          return 1;
-        }
+  int proc_count = 0;
+  fflush(stdout);
+  for (int i = 0; i < max_proc; i++) {
+    pid_t pid = fork();
 
-        int barrier = BARRIER_ON;
-        int curCmd = 0;
-        while (barrier == BARRIER_ON){
-          barrier = BARRIER_OFF;
-          HandlerResult *thread_result;
-          ThreadArgs *args = (ThreadArgs*) malloc(sizeof(ThreadArgs) * (size_t)max_threads); 
+    if (pid == -1){
+      fprintf(stderr, "Failed to fork\n");
+      break;
+    } else if (pid == 0){
+      // Only the parent answers SIGUSR1, the metrics are shared anyway
+      signal(SIGUSR1, SIG_IGN);
+      close(queue[1]);
+      close(reports[0]);
+      closedir(dirp);
+      free(jobs);
+      job_worker(queue[0], reports[1], dir_str, max_threads, &dispatch_start);
+    }
+    proc_count++;
+  }
+  close(queue[0]);
+  close(reports[1]);
 
-          if (args == NULL) {
-              fprintf(stderr, "Memory allocation error\n");
-              break;
-          }
+  for (size_t i = 0; proc_count > 0 && i < job_count; i++) {
+    // Blocks while the pipe is full, until a worker takes a job
+    if (write_all(queue[1], (const char *)&jobs[i].request, sizeof(jobs[i].request)) != 0) {
+      break;
+    }
+  }
+  // No more jobs: workers exit once they drain the queue
+  close(queue[1]);
+  free(jobs);
 
-          // create all threads
-          for (int num_threads = 0; num_threads < max_threads; num_threads++){
-            args[num_threads].thread_id = num_threads;
-            args[num_threads].file_name = file_path;
-            args[num_threads].total_threads = max_threads;
-            args[num_threads].fd_out = fd_out;
-            args[num_threads].start_line = curCmd;
-            if (pthread_create(&tids[num_threads],NULL, handle_commands, (void *)&args[num_threads]) != 0){
-              fprintf(stderr, "error creating thread.\n");
-              continue;
-            }
-          }
-          //wait for all threads
-          for (int i = 0; i < max_threads; ++i) {
-            pthread_join(tids[i], (void **)&thread_result);
-            if (thread_result != NULL) {
-              int barrier_state = thread_result->barrier_state;
-              if (barrier_state == BARRIER_ON) {
-                barrier = thread_result->barrier_state;
-                curCmd = thread_result->curCmd;
-              }
-            }
-            free(thread_result);
-          }
-          if (barrier ==1)
-          free(args);
-        }
-        
-        free(file_out_path);
-        free(file_name);
-        free(file_path);
-
-        close(fd_in);
-        close(fd_out);
-        exit(0);
-      } else {
-        // Parent process
-        proc_count++;
-      }
+  // One report per worker, the pipe reaches EOF once all of them have exited
+  struct WorkerReport *worker_reports = calloc((size_t)max_proc, sizeof(struct WorkerReport));
+  size_t report_count = 0;
+  struct WorkerReport report;
+  ssize_t bytes_read;
+  while ((bytes_read = read(reports[0], &report, sizeof(report))) != 0) {
+    if (bytes_read < 0 && errno == EINTR) {
+      dump_requested_metrics();
+      continue;
+    }
+    if (bytes_read != (ssize_t)sizeof(report)) break;
+    if (worker_reports != NULL && report_count < (size_t)max_proc) {
+      worker_reports[report_count++] = report;
     }
   }
+  close(reports[0]);
 
-  // Wait for all remaining child processes to finish
+  // Wait for all the worker processes to finish
   while (proc_count > 0) {
     int status;
     pid_t terminated_pid = wait(&status);
@@ -322,8 +1263,25 @@ int main(int argc, char *argv[]) {
       printf("Child process %d terminated\n", terminated_pid);
       proc_count--;
     }
+    dump_requested_metrics();
+  }
+
+  if (print_utilization && worker_reports != NULL) {
+    double makespan_ms = 0;
+    for (size_t i = 0; i < report_count; i++) {
+      if (worker_reports[i].alive_ms > makespan_ms) makespan_ms = worker_reports[i].alive_ms;
+    }
+    for (size_t i = 0; i < report_count; i++) {
+      printf("Process %d: %zu jobs, busy %.1f ms, idle %.1f ms of %.1f ms\n", worker_reports[i].pid,
+             worker_reports[i].jobs, worker_reports[i].busy_ms, makespan_ms - worker_reports[i].busy_ms, makespan_ms);
+    }
+  }
+  free(worker_reports);
+
+  if (metrics_fd >= 0 && metrics_dump(metrics_fd) != 0) {
+    fprintf(stderr, "Failed to write the metrics\n");
   }
   ems_terminate();
   closedir(dirp);
   return 0;
-}
\ No newline at end of file
+}
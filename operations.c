@@ -1,12 +1,22 @@
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include "eventlist.h"
 #include "constants.h"
+#include "operations.h"
+#include "outbuf.h"
+#include "arena.h"
+#include "stats.h"
+
+/// Slots of the table of taken seats a sparse event starts with.
+#define INITIAL_SPARSE_SEATS 64
 
 typedef struct {
     size_t x;
@@ -15,10 +25,70 @@ typedef struct {
 
 static struct EventList* event_list = NULL;
 static unsigned int state_access_delay_ms = 0;
+
+static enum LockGranularity lock_granularity = LOCK_PER_ROW;
+static size_t lock_granularity_param = 0;
+static int optimistic_reservations = 0;
+
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 int target_thread_id;
 
+/// Memory each thread reuses for SHOW: the snapshot of the seats being
+/// shown. Freed when the thread exits.
+struct RenderState {
+  unsigned int* seats;
+  size_t seats_capacity;
+
+  struct SparseSeat* taken;  /// Taken seats of a sparse event.
+  size_t taken_capacity;
+};
+
+static pthread_key_t render_state_key;
+
+static void free_render_state(void* state) {
+  free(((struct RenderState*)state)->seats);
+  free(((struct RenderState*)state)->taken);
+  free(state);
+}
+
+static struct RenderState* get_render_state() {
+  struct RenderState* state = pthread_getspecific(render_state_key);
+  if (state == NULL) {
+    state = calloc(1, sizeof(struct RenderState));
+    if (state == NULL || pthread_setspecific(render_state_key, state) != 0) {
+      free(state);
+      return NULL;
+    }
+  }
+  return state;
+}
+
+/// Gets the snapshot array of the calling thread, with room for num_seats seats.
+static unsigned int* get_snapshot_seats(struct RenderState* state, size_t num_seats) {
+  if (num_seats > state->seats_capacity) {
+    unsigned int* seats = realloc(state->seats, num_seats * sizeof(unsigned int));
+    if (seats == NULL) return NULL;
+
+    state->seats = seats;
+    state->seats_capacity = num_seats;
+  }
+  return state->seats;
+}
+
+/// Gets the array of the calling thread for the taken seats of a sparse event, with room for count seats.
+static struct SparseSeat* get_snapshot_taken(struct RenderState* state, size_t count) {
+  if (count == 0) count = 1;
+  if (count > state->taken_capacity) {
+    struct SparseSeat* taken = realloc(state->taken, count * sizeof(struct SparseSeat));
+    if (taken == NULL) return NULL;
+
+    state->taken = taken;
+    state->taken_capacity = count;
+  }
+  return state->taken;
+}
+
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
@@ -26,34 +96,152 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+/// Waits to simulate a real system accessing a costly memory resource.
+/// @note With a delay of 0 there is nothing to simulate, so no nanosleep
+/// system call is made.
+static void state_access_delay() {
+  if (state_access_delay_ms == 0) {
+    if (metrics_enabled()) metrics_record_state_access(0);
+    return;
+  }
+
+  uint64_t start = metrics_enabled() ? metrics_now_ns() : 0;
+  struct timespec delay = delay_to_timespec(state_access_delay_ms);
+  nanosleep(&delay, NULL);  // Should not be removed
+  if (metrics_enabled()) metrics_record_state_access(metrics_now_ns() - start);
+}
+
 /// Gets the event with the given ID from the state.
 /// @note Will wait to simulate a real system accessing a costly memory resource.
 /// @param event_id The ID of the event to get.
 /// @return Pointer to the event if found, NULL otherwise.
 static struct Event* get_event_with_delay(unsigned int event_id) {
-  struct timespec delay = delay_to_timespec(state_access_delay_ms);
-  nanosleep(&delay, NULL);  // Should not be removed
+  state_access_delay();
 
   return get_event(event_list, event_id);
 }
 
-/// Gets the seat with the given index from the state.
+/// Tells whether a seat is taken, from the occupancy bitmap.
 /// @note Will wait to simulate a real system accessing a costly memory resource.
-/// @param event Event to get the seat from.
-/// @param index Index of the seat to get.
-/// @return Pointer to the seat.
-static unsigned int* get_seat_with_delay(struct Event* event, size_t index) {
-  struct timespec delay = delay_to_timespec(state_access_delay_ms);
-  nanosleep(&delay, NULL);  // Should not be removed
+/// @param event Event the seat belongs to.
+/// @param index Index of the seat.
+/// @return 1 if the seat is taken, 0 otherwise.
+static int seat_taken_with_delay(struct Event* event, size_t index) {
+  state_access_delay();
+
+  unsigned long bit = 1ul << (index % OCCUPIED_BITS);
+  return (atomic_load_explicit(&event->occupied[index / OCCUPIED_BITS], memory_order_acquire) & bit) != 0;
+}
 
-  return &event->data[index];
+/// Sets the bit of a seat in the occupancy bitmap.
+/// @note Will wait to simulate a real system accessing a costly memory resource.
+/// @param event Event the seat belongs to.
+/// @param index Index of the seat.
+/// @return 1 if the seat was free and is now taken, 0 if it was already taken.
+static int claim_seat_with_delay(struct Event* event, size_t index) {
+  state_access_delay();
+
+  // Other seats share the word, so the bit is set atomically even under a seat lock
+  unsigned long bit = 1ul << (index % OCCUPIED_BITS);
+  return (atomic_fetch_or(&event->occupied[index / OCCUPIED_BITS], bit) & bit) == 0;
+}
+
+/// Clears the bit of a seat claimed by a reservation that failed.
+static void release_seat(struct Event* event, size_t index) {
+  atomic_fetch_and(&event->occupied[index / OCCUPIED_BITS], ~(1ul << (index % OCCUPIED_BITS)));
+}
+
+/// Largest reservation id a seat store of the given width holds.
+static unsigned int store_max_id(size_t width) { return width >= sizeof(unsigned int) ? UINT_MAX : (1u << (8 * width)) - 1; }
+
+static unsigned int load_seat_id(const struct SeatStore* store, size_t index) {
+  switch (store->width) {
+    case 1:
+      return atomic_load_explicit(&((atomic_uchar*)store->ids)[index], memory_order_relaxed);
+    case 2:
+      return atomic_load_explicit(&((atomic_ushort*)store->ids)[index], memory_order_relaxed);
+    default:
+      return atomic_load_explicit(&((atomic_uint*)store->ids)[index], memory_order_relaxed);
+  }
+}
+
+/// Writes a reservation id to a seat, it must fit the width of the store.
+static void store_seat_id(struct SeatStore* store, size_t index, unsigned int id) {
+  switch (store->width) {
+    case 1:
+      atomic_store_explicit(&((atomic_uchar*)store->ids)[index], (unsigned char)id, memory_order_release);
+      break;
+    case 2:
+      atomic_store_explicit(&((atomic_ushort*)store->ids)[index], (unsigned short)id, memory_order_release);
+      break;
+    default:
+      atomic_store_explicit(&((atomic_uint*)store->ids)[index], id, memory_order_release);
+      break;
+  }
+}
+
+/// Copies the ids of a seat store, with a loop per width so the copy stays tight.
+static void copy_seat_ids(const struct SeatStore* store, unsigned int* seats, size_t num_seats) {
+  switch (store->width) {
+    case 1:
+      for (size_t i = 0; i < num_seats; i++) {
+        seats[i] = atomic_load_explicit(&((atomic_uchar*)store->ids)[i], memory_order_relaxed);
+      }
+      break;
+    case 2:
+      for (size_t i = 0; i < num_seats; i++) {
+        seats[i] = atomic_load_explicit(&((atomic_ushort*)store->ids)[i], memory_order_relaxed);
+      }
+      break;
+    default:
+      for (size_t i = 0; i < num_seats; i++) {
+        seats[i] = atomic_load_explicit(&((atomic_uint*)store->ids)[i], memory_order_relaxed);
+      }
+      break;
+  }
 }
 
+/// Gets the lock with the given index from the state.
+/// @note Will wait to simulate a real system accessing a costly memory resource.
+/// @param event Event to get the lock from.
+/// @param index Index of the lock, as returned by lock_index.
+/// @return Pointer to the lock.
 static pthread_mutex_t* get_lock_with_delay(struct Event* event, size_t index) {
-  struct timespec delay = delay_to_timespec(state_access_delay_ms);
-  nanosleep(&delay, NULL);  // Should not be removed
+  state_access_delay();
+
+  return &event->locks[index];
+}
+
+/// Number of locks guarding an event with the given number of seats.
+static size_t locks_for_event(size_t num_rows, size_t num_cols) {
+  size_t num_seats = num_rows * num_cols;
+
+  switch (lock_granularity) {
+    case LOCK_PER_ROW:
+      return num_rows;
+    case LOCK_PER_STRIPE:
+      return (num_seats + lock_granularity_param - 1) / lock_granularity_param;
+    case LOCK_HASHED:
+      return num_seats < lock_granularity_param ? num_seats : lock_granularity_param;
+  }
+  return num_seats;
+}
 
-  return &event->mutex[index];
+/// Gets the index of the lock guarding a seat.
+/// @param event Event the seat belongs to.
+/// @param seat Index of the seat, as returned by seat_index.
+/// @return Index of the lock.
+static size_t lock_index(struct Event* event, size_t seat) {
+  switch (lock_granularity) {
+    case LOCK_PER_ROW:
+      return seat / event->cols;
+    case LOCK_PER_STRIPE:
+      return seat / lock_granularity_param;
+    case LOCK_HASHED:
+      // Neighbouring seats land on different locks
+      return (seat * 2654435761u) % event->num_locks;
+  }
+  return seat;
 }
 
 /// Gets the index of a seat.
@@ -84,12 +272,403 @@ int compare_coordinates(const void *a, const void *b) {
     }
 }
 
+static int compare_locks(const void *a, const void *b) {
+  size_t lock1 = *(const size_t *)a;
+  size_t lock2 = *(const size_t *)b;
+  return (lock1 > lock2) - (lock1 < lock2);
+}
+
+/// Locks a set of locks of an event in ascending order, which keeps
+/// concurrent reservations and shows from deadlocking.
+/// @param event Event the locks belong to.
+/// @param locks Sorted lock indexes, without repetitions.
+/// @param num_locks Number of locks.
+/// @param acquired Set to when each lock was acquired, if the event's locks are profiled.
+static void lock_all(struct Event* event, const size_t* locks, size_t num_locks, uint64_t* acquired) {
+  for (size_t i = 0; i < num_locks; i++) {
+    pthread_mutex_t* lock = get_lock_with_delay(event, locks[i]);
+    if (event->lock_profiles != NULL) {
+      acquired[i] = lock_profiled(lock, &event->lock_profiles[locks[i]]);
+    } else {
+      pthread_mutex_lock(lock);
+    }
+  }
+}
+
+static void unlock_all(struct Event* event, const size_t* locks, size_t num_locks, const uint64_t* acquired) {
+  for (size_t i = num_locks; i > 0; i--) {
+    if (event->lock_profiles != NULL) {
+      unlock_profiled(&event->locks[locks[i - 1]], &event->lock_profiles[locks[i - 1]], acquired[i - 1]);
+    } else {
+      pthread_mutex_unlock(&event->locks[locks[i - 1]]);
+    }
+  }
+}
+
+/// Locks every lock of an event, in ascending order.
+/// @return When the last lock was acquired if the locks are profiled, 0 otherwise.
+static uint64_t lock_event(struct Event* event) {
+  for (size_t i = 0; i < event->num_locks; i++) {
+    pthread_mutex_t* lock = get_lock_with_delay(event, i);
+    if (event->lock_profiles != NULL) {
+      lock_profiled(lock, &event->lock_profiles[i]);
+    } else {
+      pthread_mutex_lock(lock);
+    }
+  }
+  // Events can have a lock per row, too many to keep a time for each
+  return event->lock_profiles != NULL ? metrics_now_ns() : 0;
+}
+
+/// @param acquired Time returned by lock_event, every lock counts as held since then.
+static void unlock_event(struct Event* event, uint64_t acquired) {
+  for (size_t i = event->num_locks; i > 0; i--) {
+    if (event->lock_profiles != NULL) {
+      unlock_profiled(&event->locks[i - 1], &event->lock_profiles[i - 1], acquired);
+    } else {
+      pthread_mutex_unlock(&event->locks[i - 1]);
+    }
+  }
+}
+
+/// Gets the current seat store of an event for reading, keeping it from
+/// being freed by widen_seats until release_seat_store.
+/// @param slot Set to the reader count to give back to release_seat_store.
+static struct SeatStore* acquire_seat_store(struct Event* event, unsigned int* slot) {
+  for (;;) {
+    unsigned int generation = atomic_load(&event->seats_generation);
+    atomic_fetch_add(&event->seat_readers[generation & 1], 1);
+    // Once the generation moves, the widening that moved it only waits for the old count
+    if (atomic_load(&event->seats_generation) == generation) {
+      *slot = generation & 1;
+      return atomic_load(&event->seats);
+    }
+    atomic_fetch_sub(&event->seat_readers[generation & 1], 1);
+  }
+}
+
+static void release_seat_store(struct Event* event, unsigned int slot) {
+  atomic_fetch_sub(&event->seat_readers[slot], 1);
+}
+
+/// Bytes per reservation id in the current seat store of an event.
+static size_t seat_width(struct Event* event) {
+  unsigned int slot;
+  size_t width = acquire_seat_store(event, &slot)->width;
+  release_seat_store(event, slot);
+  return width;
+}
+
+/// Moves the seats of an event to a store wide enough for a reservation id,
+/// unless another thread already did.
+/// @note Writers are held off at begin_seat_writes for the copy, snapshots
+/// still running on the old store are waited for before it is freed.
+/// @return 0 if the seats are wide enough, 1 if memory ran out.
+static int widen_seats(struct Event* event, unsigned int reservation_id) {
+  size_t num_seats = event->rows * event->cols;
+  size_t width = reservation_id <= store_max_id(2) ? 2 : sizeof(unsigned int);
+
+  for (;;) {
+    if (reservation_id <= store_max_id(seat_width(event))) return 0;
+
+    unsigned int expected = 0;
+    if (atomic_compare_exchange_strong(&event->widening, &expected, 1)) break;
+    sched_yield();
+  }
+
+  // Only a widening frees stores, so the current one stays put from here on
+  struct SeatStore* old_store = atomic_load(&event->seats);
+  if (reservation_id <= store_max_id(old_store->width)) {
+    atomic_store(&event->widening, 0);
+    return 0;
+  }
+
+  struct SeatStore* new_store = create_seat_store(num_seats, width);
+  if (new_store == NULL) {
+    atomic_store(&event->widening, 0);
+    return 1;
+  }
+
+  // Writers that got past the gate before it closed finish first. Counting
+  // as a writer makes snapshots taken during the copy retry.
+  while (atomic_load(&event->writers) != 0) {
+    sched_yield();
+  }
+  atomic_fetch_add(&event->writers, 1);
+  for (size_t i = 0; i < num_seats; i++) {
+    store_seat_id(new_store, i, load_seat_id(old_store, i));
+  }
+  atomic_store(&event->seats, new_store);
+  atomic_fetch_add(&event->version, 1);
+  atomic_fetch_sub(&event->writers, 1);
+  atomic_store(&event->widening, 0);
+
+  // Snapshots started from now on see the new store, the ones still counted
+  // under the old generation may be copying from the old one
+  unsigned int generation = atomic_fetch_add(&event->seats_generation, 1);
+  while (atomic_load(&event->seat_readers[generation & 1]) != 0) {
+    sched_yield();
+  }
+  free_seat_store(old_store);
+  return 0;
+}
+
+/// Announces that seats of an event are about to change, so that
+/// snapshots taken meanwhile are retried, and widens the seats if the
+/// reservation id does not fit them.
+/// @note Waits while a SHOW holds writers off, see snapshot_seats.
+/// @return Store to write the ids to, NULL if it could not be widened.
+static struct SeatStore* begin_seat_writes(struct Event* event, unsigned int reservation_id) {
+  for (;;) {
+    atomic_fetch_add(&event->writers, 1);
+    // Pairs with snapshot_seats: either the SHOW sees this writer or it is seen here
+    if (atomic_load(&event->gated_shows) != 0) {
+      atomic_fetch_sub(&event->writers, 1);
+      while (atomic_load(&event->gated_shows) != 0) {
+        sched_yield();
+      }
+      continue;
+    }
+
+    if (atomic_load(&event->widening) == 0) {
+      struct SeatStore* store = atomic_load(&event->seats);
+      if (reservation_id <= store_max_id(store->width)) return store;
+    }
+
+    atomic_fetch_sub(&event->writers, 1);
+    if (widen_seats(event, reservation_id) != 0) return NULL;
+  }
+}
+
+/// Announces that the changes started by begin_seat_writes are done.
+static void end_seat_writes(struct Event* event) {
+  // The version moves before the writer leaves, so a snapshot that saw no
+  // writers at both ends and the same version missed nothing.
+  atomic_fetch_add(&event->version, 1);
+  atomic_fetch_sub(&event->writers, 1);
+}
+
+/// Copies the seats of an event as they were at a single point in time.
+/// Seats are copied without locks and the copy is retried if a reservation
+/// wrote to the event meanwhile. After SNAPSHOT_RETRIES attempts, new
+/// writers are held off at begin_seat_writes, locked and optimistic alike,
+/// so only the reservations already writing and at most one widening of
+/// the seats can make the copy retry again.
+/// @param event Event to copy.
+/// @param seats Array of rows * cols entries to copy the reservation ids to.
+static void snapshot_seats(struct Event* event, unsigned int* seats) {
+  size_t num_seats = event->rows * event->cols;
+  int gated = 0;
+
+  state_access_delay();
+  for (unsigned int attempt = 0;; attempt++) {
+    if (attempt > 0) {
+      atomic_fetch_add_explicit(&event->snapshot_retries, 1, memory_order_relaxed);
+    }
+    if (attempt == SNAPSHOT_RETRIES) {
+      atomic_fetch_add(&event->gated_shows, 1);
+      gated = 1;
+    }
+
+    unsigned long version = atomic_load(&event->version);
+    if (atomic_load(&event->writers) != 0) {
+      sched_yield();
+      continue;
+    }
+
+    unsigned int slot;
+    struct SeatStore* store = acquire_seat_store(event, &slot);
+    copy_seat_ids(store, seats, num_seats);
+    release_seat_store(event, slot);
+
+    // Pairs with the release stores of the writers: if any seat written by
+    // a reservation was copied, that reservation is seen below.
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load(&event->writers) == 0 && atomic_load(&event->version) == version) {
+      break;
+    }
+  }
+
+  if (gated) {
+    atomic_fetch_sub(&event->gated_shows, 1);
+  }
+}
+
+/// Writes the id of a new reservation to its seats.
+/// @param seats Indexes of the seats, already claimed in the occupancy bitmap.
+/// @return 0 if the ids were written, 1 if the seats could not be widened to fit the id.
+static int write_reservation(struct Event* event, const size_t* seats, size_t num_seats) {
+  unsigned int reservation_id = atomic_fetch_add(&event->reservations, 1) + 1;
+  struct SeatStore* store = begin_seat_writes(event, reservation_id);
+  if (store == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    return 1;
+  }
+  for (size_t i = 0; i < num_seats; i++) {
+    store_seat_id(store, seats[i], reservation_id);
+  }
+  end_seat_writes(event);
+  return 0;
+}
+
+/// Reserves seats without taking any lock, claiming each seat's bit in the
+/// occupancy bitmap atomically and releasing the claimed ones if another
+/// reservation got to a seat first.
+/// @note The seats must be valid and sorted.
+static int reserve_optimistic(struct Event* event, size_t num_seats, size_t* xs, size_t* ys) {
+  size_t seats[num_seats];
+  size_t num_claimed = 0;
+
+  for (size_t i = 0; i < num_seats; i++) {
+    // A seat asked for twice is claimed once
+    if (i > 0 && xs[i] == xs[i - 1] && ys[i] == ys[i - 1]) {
+      continue;
+    }
+
+    size_t seat = seat_index(event, xs[i], ys[i]);
+    if (!claim_seat_with_delay(event, seat)) {
+      fprintf(stderr, "Seat already reserved\n");
+      for (size_t j = 0; j < num_claimed; j++) {
+        release_seat(event, seats[j]);
+      }
+      return 1;
+    }
+    seats[num_claimed++] = seat;
+  }
+
+  // The id is only taken once every seat is ours, so failed attempts leave
+  // no gaps and ids stay the same as with locks.
+  // Claimed seats show as free, only writing the ids is visible to SHOW
+  if (write_reservation(event, seats, num_claimed) != 0) {
+    for (size_t j = 0; j < num_claimed; j++) {
+      release_seat(event, seats[j]);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/// Reserves seats of a sparse event.
+/// @note Must be called with the only lock of the event held. The seats
+/// must be valid and sorted.
+static int reserve_sparse(struct Event* event, size_t num_seats, size_t* xs, size_t* ys) {
+  for (size_t i = 0; i < num_seats; i++) {
+    state_access_delay();
+    if (sparse_seat_get(event->sparse, seat_index(event, xs[i], ys[i])) != 0) {
+      fprintf(stderr, "Seat already reserved\n");
+      return 1;
+    }
+  }
+
+  // Room is made first, so a reservation is never left half written
+  if (sparse_seats_reserve(&event->sparse, num_seats) != 0) {
+    fprintf(stderr, "Memory allocation error\n");
+    return 1;
+  }
+
+  unsigned int reservation_id = atomic_fetch_add(&event->reservations, 1) + 1;
+  for (size_t i = 0; i < num_seats; i++) {
+    // A seat asked for twice is taken once
+    if (i > 0 && xs[i] == xs[i - 1] && ys[i] == ys[i - 1]) {
+      continue;
+    }
+
+    state_access_delay();
+    sparse_seat_set(event->sparse, seat_index(event, xs[i], ys[i]), reservation_id);
+  }
+  return 0;
+}
+
+/// Reserves seats with the locks covering them held.
+/// @note The seats must be valid and sorted.
+static int reserve_locked(struct Event* event, size_t num_seats, size_t* xs, size_t* ys) {
+  for (size_t i = 0; i < num_seats; i++) {
+    if (seat_taken_with_delay(event, seat_index(event, xs[i], ys[i]))) {
+      fprintf(stderr, "Seat already reserved\n");
+      return 1;
+    }
+  }
+
+  // A seat asked for twice is written once
+  size_t seats[num_seats];
+  size_t num_claimed = 0;
+  for (size_t i = 0; i < num_seats; i++) {
+    size_t seat = seat_index(event, xs[i], ys[i]);
+    if (claim_seat_with_delay(event, seat)) {
+      seats[num_claimed++] = seat;
+    }
+  }
+  if (write_reservation(event, seats, num_claimed) != 0) {
+    for (size_t i = 0; i < num_claimed; i++) {
+      release_seat(event, seats[i]);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/// Sorts the seats of a reservation and checks that they all exist.
+/// @return 0 if every seat exists, 1 otherwise.
+static int sort_seats(struct Event* event, size_t num_seats, size_t* xs, size_t* ys) {
+  Coordinate coordinates[num_seats];
+  for (int i=0; i<(int)num_seats;i++){
+    coordinates[i].x= xs[i];
+    coordinates[i].y= ys[i];
+  }
+
+  qsort(coordinates, num_seats, sizeof(Coordinate), compare_coordinates);
+
+  for (int i=0; i< (int)num_seats;i++){
+    xs[i]=coordinates[i].x;
+    ys[i]=coordinates[i].y;
+  }
+
+  for (size_t i = 0; i < num_seats; i++) {
+    if (xs[i] <= 0 || xs[i] > event->rows || ys[i] <= 0 || ys[i] > event->cols) {
+      fprintf(stderr, "Invalid seat\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int ems_set_shared_memory(size_t size) {
+  if (event_list != NULL) {
+    fprintf(stderr, "Shared memory must be set up before initializing the EMS state\n");
+    return 1;
+  }
+
+  return arena_init_shared(size);
+}
+
+void ems_set_optimistic_reservations(int enabled) { optimistic_reservations = enabled; }
+
+int ems_set_lock_granularity(enum LockGranularity granularity, size_t param) {
+  if (event_list != NULL) {
+    fprintf(stderr, "Lock granularity must be set before initializing the EMS state\n");
+    return 1;
+  }
+  if (granularity != LOCK_PER_ROW && param == 0) {
+    fprintf(stderr, "Invalid lock granularity\n");
+    return 1;
+  }
+
+  lock_granularity = granularity;
+  lock_granularity_param = param;
+  return 0;
+}
+
 int ems_init(unsigned int delay_ms) {
   if (event_list != NULL) {
     fprintf(stderr, "EMS state has already been initialized\n");
     return 1;
   }
 
+  if (pthread_key_create(&render_state_key, free_render_state) != 0) {
+    fprintf(stderr, "Failed to create render state key\n");
+    return 1;
+  }
+
   event_list = create_list();
   state_access_delay_ms = delay_ms;
 
@@ -103,6 +682,26 @@ int ems_terminate() {
   }
 
   free_list(event_list);
+  arena_destroy();
+
+  struct RenderState* state = pthread_getspecific(render_state_key);
+  if (state != NULL) {
+    free_render_state(state);
+  }
+  pthread_key_delete(render_state_key);
+  return 0;
+}
+
+int ems_reset() {
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    return 1;
+  }
+  if (arena_is_shared()) {
+    return 0;
+  }
+
+  reset_list(event_list);
   return 0;
 }
 
@@ -117,7 +716,12 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
     return 1;
   }
 
-  struct Event* event = malloc(sizeof(struct Event));
+  // Huge events only keep the seats that get taken, behind a single lock,
+  // so creating them costs the same as creating a small one
+  size_t num_seats = num_rows * num_cols;
+  int sparse = num_seats > SPARSE_EVENT_SEATS;
+  size_t num_locks = sparse ? 1 : locks_for_event(num_rows, num_cols);
+  struct Event* event = alloc_event(event_list, sparse ? 0 : num_seats, num_locks, lock_profiling_enabled());
 
   if (event == NULL) {
     fprintf(stderr, "Error allocating memory for event\n");
@@ -127,31 +731,50 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
   event->id = event_id;
   event->rows = num_rows;
   event->cols = num_cols;
-  event->reservations = 0;
-  event->data = malloc(num_rows * num_cols * sizeof(unsigned int));
-  event->mutex = malloc(num_rows * num_cols * sizeof(pthread_mutex_t));
-
-  if (event->data == NULL) {
-    fprintf(stderr, "Error allocating memory for event data\n");
-    free(event);
-    return 1;
+  event->is_sparse = sparse;
+  atomic_init(&event->reservations, 0);
+  atomic_init(&event->writers, 0);
+  atomic_init(&event->widening, 0);
+  atomic_init(&event->gated_shows, 0);
+  atomic_init(&event->seats_generation, 0);
+  atomic_init(&event->seat_readers[0], 0);
+  atomic_init(&event->seat_readers[1], 0);
+  atomic_init(&event->version, 0);
+  atomic_init(&event->snapshot_retries, 0);
+  if (event->lock_profiles != NULL) {
+    // Zeroed counters are valid atomics
+    memset(event->lock_profiles, 0, num_locks * sizeof(struct LockProfile));
   }
 
-  for (size_t i = 0; i < num_rows * num_cols; i++) {
-    event->data[i] = 0;
+  if (sparse) {
+    event->sparse = create_sparse_seats(INITIAL_SPARSE_SEATS);
+    if (event->sparse == NULL) {
+      fprintf(stderr, "Error allocating memory for event data\n");
+      discard_event(event_list, event);
+      return 1;
+    }
+  } else {
+    // Zeroed bits and ids are valid atomics
+    memset(event->occupied, 0, (num_seats + OCCUPIED_BITS - 1) / OCCUPIED_BITS * sizeof(atomic_ulong));
+    memset(atomic_load(&event->seats)->ids, 0, num_seats);
   }
 
-  for (size_t i = 0; i < num_rows * num_cols; i++) {
-    if (pthread_mutex_init(&event->mutex[i], NULL) != 0) {
+  for (size_t i = 0; i < event->num_locks; i++) {
+    if (arena_mutex_init(&event->locks[i]) != 0) {
         fprintf(stderr, "Error initializing mutex %zu\n", i);
     }
   }
 
-  if (append_to_list(event_list, event) != 0) {
-    fprintf(stderr, "Error appending event to list\n");
-    free(event->data);
-    free(event->mutex);
-    free(event);
+  // Another thread may have created the same event since the lookup above,
+  // append_to_list checks again atomically.
+  int appended = append_to_list(event_list, event);
+  if (appended != 0) {
+    if (appended == EVENT_EXISTS) {
+      fprintf(stderr, "Event already exists\n");
+    } else {
+      fprintf(stderr, "Error appending event to list\n");
+    }
+    discard_event(event_list, event);
     return 1;
   }
 
@@ -159,6 +782,15 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
 }
 
 int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys) {
+  int result;
+  if (ems_reserve_batch(event_id, 1, &num_seats, xs, ys, &result) != 0) {
+    return 1;
+  }
+  return result;
+}
+
+int ems_reserve_batch(unsigned int event_id, size_t num_reservations, const size_t* sizes, size_t* xs, size_t* ys,
+                      int* results) {
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
@@ -168,81 +800,137 @@ int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys)
 
   if (event == NULL) {
     fprintf(stderr, "Event not found\n");
+    for (size_t r = 0; r < num_reservations; r++) {
+      results[r] = 1;
+    }
     return 1;
   }
-  Coordinate coordinates[num_seats];
-  for (int i=0; i<(int)num_seats;i++){
-    coordinates[i].x= xs[i];
-    coordinates[i].y= ys[i];
-  }
 
-  qsort(coordinates, num_seats, sizeof(Coordinate), compare_coordinates);
-
-  for (int i=0; i< (int)num_seats;i++){
-    xs[i]=coordinates[i].x;
-    ys[i]=coordinates[i].y;
+  size_t total_seats = 0;
+  for (size_t r = 0; r < num_reservations; r++) {
+    results[r] = sort_seats(event, sizes[r], xs + total_seats, ys + total_seats);
+    total_seats += sizes[r];
   }
 
-  unsigned int reservation_id = ++event->reservations;
+  if (optimistic_reservations && !event->is_sparse) {
+    for (size_t r = 0, first = 0; r < num_reservations; first += sizes[r++]) {
+      if (results[r] == 0) {
+        results[r] = reserve_optimistic(event, sizes[r], xs + first, ys + first);
+      }
+    }
+    return 0;
+  }
 
-  size_t e =0;
-  size_t j=0;
-  for(; e<num_seats; e++){
-    size_t row = xs[e];
-    size_t col = ys[e];
-    pthread_mutex_lock(get_lock_with_delay(event, seat_index(event, row, col)));
-    if (row <= 0 || row > event->rows || col <= 0 || col > event->cols) {
-      fprintf(stderr, "Invalid seat\n");
-      for (j = 0; j <= e; j++) {
-        pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, xs[j], ys[j])));
+  // Every lock covering a seat of a valid reservation, sorted and without
+  // repetitions, so the whole batch takes each lock once
+  size_t locks[total_seats + 1];
+  size_t num_locks = 0;
+  if (event->is_sparse) {
+    locks[num_locks++] = 0;
+  } else {
+    for (size_t r = 0, first = 0; r < num_reservations; first += sizes[r++]) {
+      for (size_t i = first; results[r] == 0 && i < first + sizes[r]; i++) {
+        locks[num_locks++] = lock_index(event, seat_index(event, xs[i], ys[i]));
       }
-      return 1;
     }
-    if (*get_seat_with_delay(event, seat_index(event, row, col)) != 0) {
-      fprintf(stderr, "Seat already reserved\n");
-      for (j = 0; j <= e; j++) {
-        pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, xs[j], ys[j])));
+    qsort(locks, num_locks, sizeof(size_t), compare_locks);
+    size_t num_unique = 0;
+    for (size_t i = 0; i < num_locks; i++) {
+      if (num_unique == 0 || locks[num_unique - 1] != locks[i]) {
+        locks[num_unique++] = locks[i];
       }
-      return 1;
     }
+    num_locks = num_unique;
   }
-  if (e < num_seats) {
-    event->reservations--;
-    for (j = 0; j <= e; j++) {
-      pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, xs[j], ys[j])));
+
+  // Reservations are made in order, each one seeing the seats taken by the ones before it
+  uint64_t acquired[num_locks + 1];
+  lock_all(event, locks, num_locks, acquired);
+  for (size_t r = 0, first = 0; r < num_reservations; first += sizes[r++]) {
+    if (results[r] != 0) continue;
+
+    if (event->is_sparse) {
+      results[r] = reserve_sparse(event, sizes[r], xs + first, ys + first);
+    } else {
+      results[r] = reserve_locked(event, sizes[r], xs + first, ys + first);
     }
-    return 1;
   }
+  unlock_all(event, locks, num_locks, acquired);
+  return 0;
+}
 
-  size_t i = 0;
-  for (; i < num_seats; i++) {
-    size_t row = xs[i];
-    size_t col = ys[i];
-    *get_seat_with_delay(event, seat_index(event, row, col)) = reservation_id;
+/// Passes the output formatted so far on to its sink, before it grows past
+/// RENDER_FLUSH_BYTES, so huge grids never sit whole in memory.
+/// @param next_bytes Number of bytes about to be formatted.
+/// @return 0 on success, 1 if the sink failed.
+static int flush_render(struct OutputBuffer* out, const struct OutputSink* sink, size_t next_bytes) {
+  if (sink == NULL || out->len == 0 || out->len + next_bytes <= RENDER_FLUSH_BYTES) {
+    return 0;
   }
+  return sink->flush(sink->context, out) != 0;
+}
 
-  // If the reservation was not successful, free the seats that were reserved.
-  if (i < num_seats) {
-    event->reservations--;
-    for (j = 0; j < i; j++) {
-      *get_seat_with_delay(event, seat_index(event, xs[j], ys[j])) = 0;
-    }
-    for (j = 0; j <= e; j++) {
-      pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, xs[j], ys[j])));
+static int compare_sparse_seats(const void* a, const void* b) {
+  size_t seat1 = ((const struct SparseSeat*)a)->seat;
+  size_t seat2 = ((const struct SparseSeat*)b)->seat;
+  return (seat1 > seat2) - (seat1 < seat2);
+}
+
+/// Shows a sparse event. Its taken seats are copied under its lock, then
+/// the whole grid is rendered from the copy, with every other seat free.
+static int show_sparse(struct Event* event, struct RenderState* state, struct OutputBuffer* out,
+                       const struct OutputSink* sink) {
+  uint64_t acquired = lock_event(event);
+  const struct SparseSeats* sparse = event->sparse;
+  struct SparseSeat* taken = get_snapshot_taken(state, sparse->count);
+  size_t num_taken = 0;
+  if (taken != NULL) {
+    for (size_t i = 0; i < sparse->size; i++) {
+      if (sparse->slots[i].id != 0) {
+        taken[num_taken++] = sparse->slots[i];
+      }
     }
+  }
+  unlock_event(event, acquired);
+
+  if (taken == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
     return 1;
   }
+  qsort(taken, num_taken, sizeof(struct SparseSeat), compare_sparse_seats);
+
+  // Room for a row: up to 10 digits and a separator per seat
+  size_t row_bytes = event->cols * 11;
+  size_t next = 0;
+
+  for (size_t i = 0; i < event->rows; i++) {
+    if (flush_render(out, sink, row_bytes) != 0) {
+      return 1;
+    }
+
+    char* line = outbuf_reserve(out, row_bytes);
+    if (line == NULL) {
+      fprintf(stderr, "Memory allocation error\n");
+      return 1;
+    }
 
-  for (j = 0; j < e; j++) {
-    pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, xs[j], ys[j])));
+    size_t len = 0;
+    for (size_t j = 0; j < event->cols; j++) {
+      size_t seat = i * event->cols + j;
+      if (next < num_taken && taken[next].seat == seat) {
+        len += format_uint(line + len, taken[next++].id);
+      } else {
+        line[len++] = '0';
+      }
+      line[len++] = j + 1 < event->cols ? ' ' : '\n';
+    }
+    out->len += len;
   }
+
   return 0;
 }
 
-int ems_show(unsigned int event_id, int fd_out) {
-  size_t len;
-  int done;
-
+int ems_show(unsigned int event_id, struct OutputBuffer* out, const struct OutputSink* sink) {
   struct Event* event = get_event_with_delay(event_id);
 
   if (event_list == NULL) {
@@ -255,171 +943,171 @@ int ems_show(unsigned int event_id, int fd_out) {
     return 1;
   }
 
-  size_t x =1;
-  for(; x<=event->cols; x++){
-    size_t y =1;
-    for(; y<=event->rows; y++)
-    pthread_mutex_lock(get_lock_with_delay(event, seat_index(event, x, y)));
+  struct RenderState* state = get_render_state();
+  if (state != NULL && event->is_sparse) {
+    return show_sparse(event, state, out, sink);
   }
-  for (size_t i = 1; i <= event->rows; i++) {
-    for (size_t j = 1; j <= event->cols; j++) {
-      unsigned int* seat = get_seat_with_delay(event, seat_index(event, i, j));
-
-      char *str = (char*) malloc(sizeof(*seat));
-
-      if (str == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        for(x=1; x<=event->cols; x++){
-          size_t y =1;
-          for(; y<=event->rows; y++)
-            pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, x, y)));
-        }
-        return 1;
-      }
 
-      sprintf(str, "%u", *seat);
-
-      len = strlen(str);
-      done = 0;
-      while (len > 0) {
-        ssize_t bytes_written = write(fd_out, str + done, len);
-
-        if (bytes_written < 0){
-          fprintf(stderr, "write error: %s\n", strerror(errno));
-          for(x=1; x<=event->cols; x++){
-           size_t y =1;
-            for(; y<=event->rows; y++)
-              pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, x, y)));
-          }
-          return -1;
-        }
-
-        /* might not have managed to write all, len becomes what remains */
-        len -= (size_t) bytes_written;
-        done += (int) bytes_written;
-      }
-
-      if (j < event->cols) {
-
-        len = strlen(" ");
-        done = 0;
-        while (len > 0) {
-          ssize_t bytes_written = write(fd_out, " " + done, len);
+  unsigned int* seats = state ? get_snapshot_seats(state, event->rows * event->cols) : NULL;
+  if (seats == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    return 1;
+  }
 
-          if (bytes_written < 0){
-            fprintf(stderr, "write error: %s\n", strerror(errno));
-            for(x=1; x<=event->cols; x++){
-              size_t y =1;
-              for(; y<=event->rows; y++)
-                pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, x, y)));
-            }
-            return -1;
-          }
+  // Reservations keep going while the copy is rendered and written
+  snapshot_seats(event, seats);
 
-          /* might not have managed to write all, len becomes what remains */
-          len -= (size_t) bytes_written;
-          done += (int) bytes_written;
-        }
-      }
+  // Room for a row: up to 10 digits and a separator per seat
+  size_t row_bytes = event->cols * 11;
 
-      free(str);
+  for (size_t i = 0; i < event->rows; i++) {
+    if (flush_render(out, sink, row_bytes) != 0) {
+      return 1;
     }
 
-    len = strlen("\n");
-    done = 0;
-    while (len > 0) {
-      ssize_t bytes_written = write(fd_out, "\n" + done, len);
-
-      if (bytes_written < 0){
-        fprintf(stderr, "write error: %s\n", strerror(errno));
-        for(x=1; x<=event->cols; x++){
-          size_t y =1;
-          for(; y<=event->rows; y++)
-            pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, x, y)));
-        }
-        return -1;
-      }
+    char* line = outbuf_reserve(out, row_bytes);
+    if (line == NULL) {
+      fprintf(stderr, "Memory allocation error\n");
+      return 1;
+    }
 
-      /* might not have managed to write all, len becomes what remains */
-      len -= (size_t) bytes_written;
-      done += (int) bytes_written;
+    const unsigned int* row = &seats[i * event->cols];
+    size_t len = 0;
+    for (size_t j = 0; j < event->cols; j++) {
+      len += format_uint(line + len, row[j]);
+      line[len++] = j + 1 < event->cols ? ' ' : '\n';
     }
+    out->len += len;
   }
-  for(x=1; x<=event->cols; x++){
-    size_t y =1;
-      for(; y<=event->rows; y++)
-        pthread_mutex_unlock(get_lock_with_delay(event, seat_index(event, x, y)));
-  }
+
   return 0;
 }
 
-int ems_list_events(int fd_out) {
-  size_t len;
-  int done;
-
+int ems_list_events(struct OutputBuffer* out, const struct OutputSink* sink) {
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
   }
 
   if (event_list->head == NULL) {
-
-      len = strlen(MSG_NO_EVENTS);
-      done = 0;
-      while (len > 0) {
-        ssize_t bytes_written = write(fd_out, MSG_NO_EVENTS + done, len);
-
-        if (bytes_written < 0){
-          fprintf(stderr, "write error: %s\n", strerror(errno));
-          return -1;
-        }
-
-        /* might not have managed to write all, len becomes what remains */
-        len -= (size_t) bytes_written;
-        done += (int) bytes_written;
-      }
-
-    return 0;
+    return outbuf_append(out, MSG_NO_EVENTS, strlen(MSG_NO_EVENTS));
   }
 
   struct ListNode* current = event_list->head;
   while (current != NULL) {
-    size_t str_length = (size_t) snprintf(NULL, 0, "Event: %u\n", (current->event)->id) + 1;  
-    char* str = (char*) malloc(str_length);
+    if (flush_render(out, sink, strlen("Event: \n") + 10) != 0) {
+      return 1;
+    }
 
-    if (str == NULL) {
+    char* line = outbuf_reserve(out, strlen("Event: \n") + 10);
+    if (line == NULL) {
       fprintf(stderr, "Memory allocation error\n");
       return 1;
     }
 
-    sprintf(str, "Event: %u\n", (current->event)->id);
-
-    len = strlen(str);
-    done = 0;
-    while (len > 0) {
-        ssize_t bytes_written = write(fd_out, str + done, len);
-
-        if (bytes_written < 0){
-          fprintf(stderr, "write error: %s\n", strerror(errno));
-          return -1;
-        }
-
-        /* might not have managed to write all, len becomes what remains */
-        len -= (size_t) bytes_written;
-        done += (int) bytes_written;
-    }
+    size_t len = strlen("Event: ");
+    memcpy(line, "Event: ", len);
+    len += format_uint(line + len, current->event->id);
+    line[len++] = '\n';
+    out->len += len;
 
     current = current->next;
-    
-    free(str);
   }
 
   return 0;
 }
 
-
 void ems_wait(unsigned int delay_ms) {
     struct timespec delay = {delay_ms / 1000, \
                     (delay_ms % 1000) * 1000000}; //{Seconds, Nanoseconds} Converted from miliseconds
     nanosleep(&delay, NULL);  // Sleep for the specified delay
-}
\ No newline at end of file
+}
+
+/// Contention of one lock, or of all the locks of an event, for the report.
+struct LockEntry {
+  const struct Event* event;
+  size_t lock;   /// Index of the lock, unused for a whole event.
+  struct LockProfile profile;
+};
+
+/// Orders by wait time, then contended acquires, then hold time, all descending.
+static int compare_lock_entries(const void* a, const void* b) {
+  const struct LockProfile* p1 = &((const struct LockEntry*)a)->profile;
+  const struct LockProfile* p2 = &((const struct LockEntry*)b)->profile;
+  unsigned long keys1[] = {atomic_load(&p1->wait_ns), atomic_load(&p1->contended), atomic_load(&p1->hold_ns)};
+  unsigned long keys2[] = {atomic_load(&p2->wait_ns), atomic_load(&p2->contended), atomic_load(&p2->hold_ns)};
+  for (size_t i = 0; i < 3; i++) {
+    if (keys1[i] != keys2[i]) return keys1[i] < keys2[i] ? 1 : -1;
+  }
+  return 0;
+}
+
+int ems_lock_report(struct OutputBuffer* out, size_t top) {
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    return 1;
+  }
+
+  size_t num_events = 0, num_locks = 0;
+  for (struct ListNode* node = atomic_load(&event_list->head); node != NULL; node = atomic_load(&node->next)) {
+    if (node->event->lock_profiles != NULL) {
+      num_events++;
+      num_locks += node->event->num_locks;
+    }
+  }
+  if (num_events == 0) {
+    return 0;
+  }
+
+  struct LockEntry* events = calloc(num_events, sizeof(struct LockEntry));
+  struct LockEntry* locks = calloc(num_locks, sizeof(struct LockEntry));
+  if (events == NULL || locks == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    free(events);
+    free(locks);
+    return 1;
+  }
+
+  size_t e = 0, l = 0;
+  for (struct ListNode* node = atomic_load(&event_list->head); node != NULL && e < num_events;
+       node = atomic_load(&node->next)) {
+    const struct Event* event = node->event;
+    if (event->lock_profiles == NULL) continue;
+
+    events[e].event = event;
+    for (size_t i = 0; i < event->num_locks && l < num_locks; i++, l++) {
+      locks[l].event = event;
+      locks[l].lock = i;
+      lock_profile_add(&locks[l].profile, &event->lock_profiles[i]);
+      lock_profile_add(&events[e].profile, &event->lock_profiles[i]);
+    }
+    e++;
+  }
+  qsort(events, e, sizeof(struct LockEntry), compare_lock_entries);
+  qsort(locks, l, sizeof(struct LockEntry), compare_lock_entries);
+
+  // Rows are only worth naming when each lock guards one
+  const char* lock_name = lock_granularity == LOCK_PER_ROW ? "row" : "lock";
+  char label[96];
+  int failed = outbuf_append(out, "Most contended events:\n", strlen("Most contended events:\n"));
+  for (size_t i = 0; i < e && i < top; i++) {
+    snprintf(label, sizeof(label), "event %u (%lu snapshot retries)", events[i].event->id,
+             atomic_load(&events[i].event->snapshot_retries));
+    failed |= lock_profile_format(out, label, &events[i].profile);
+  }
+  failed |= outbuf_append(out, "Most contended seat locks:\n", strlen("Most contended seat locks:\n"));
+  for (size_t i = 0; i < l && i < top; i++) {
+    if (locks[i].event->is_sparse) {
+      // The only lock of a sparse event guards all of its seats
+      snprintf(label, sizeof(label), "event %u seat map", locks[i].event->id);
+    } else {
+      // Rows are numbered from 1 in the job files
+      snprintf(label, sizeof(label), "event %u %s %zu", locks[i].event->id, lock_name, locks[i].lock + 1);
+    }
+    failed |= lock_profile_format(out, label, &locks[i].profile);
+  }
+
+  free(events);
+  free(locks);
+  return failed;
+}
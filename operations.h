@@ -3,6 +3,36 @@
 
 #include <stddef.h>
 
+#include "outbuf.h"
+
+/// How seats are grouped under a lock.
+enum LockGranularity {
+  LOCK_PER_ROW,     /// One lock per row.
+  LOCK_PER_STRIPE,  /// One lock per run of N consecutive seats.
+  LOCK_HASHED,      /// Seats are hashed over at most N locks per event.
+};
+
+/// Sets how seats of the events created from now on are locked.
+/// @note Must be called before ems_init. Defaults to LOCK_PER_ROW.
+/// @param granularity Seat grouping.
+/// @param param Seats per stripe for LOCK_PER_STRIPE, number of locks for LOCK_HASHED.
+/// @return 0 if the granularity was set successfully, 1 otherwise.
+int ems_set_lock_granularity(enum LockGranularity granularity, size_t param);
+
+/// Makes reservations claim seats with atomic compare-and-swap instead of
+/// taking the seat locks. A reservation that finds a taken seat releases
+/// the seats it already claimed, so reservations stay all-or-nothing.
+/// @param enabled 1 to reserve optimistically, 0 to lock (default).
+void ems_set_optimistic_reservations(int enabled);
+
+/// Keeps the EMS state (events, seats and their locks) in memory shared by
+/// every process forked after ems_init, so all of them work on the same
+/// events instead of a private copy each.
+/// @note Must be called before ems_init.
+/// @param size Bytes of shared memory to reserve for the state.
+/// @return 0 if the shared memory was set up successfully, 1 otherwise.
+int ems_set_shared_memory(size_t size);
+
 /// Initializes the EMS state.
 /// @param delay_ms State access delay in milliseconds.
 /// @return 0 if the EMS state was initialized successfully, 1 otherwise.
@@ -11,6 +41,12 @@ int ems_init(unsigned int delay_ms);
 /// Destroys the EMS state.
 int ems_terminate();
 
+/// Drops every event, so that the next job starts from an empty state.
+/// @note Does nothing when the events are in shared memory, where other
+/// processes may still be using them.
+/// @return 0 if the state was reset successfully, 1 otherwise.
+int ems_reset();
+
 /// Creates a new event with the given id and dimensions.
 /// @param event_id Id of the event to be created.
 /// @param num_rows Number of rows of the event to be created.
@@ -26,14 +62,44 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols);
 /// @return 0 if the reservation was created successfully, 1 otherwise.
 int ems_reserve(unsigned int event_id, size_t num_seats, size_t *xs, size_t *ys);
 
+/// Creates several reservations for the given event at once. The event is
+/// looked up once and every seat lock the batch needs is taken once, then
+/// the reservations are made in order, as if by consecutive ems_reserve
+/// calls that nothing else ran between.
+/// @param event_id Id of the event to create the reservations for.
+/// @param num_reservations Number of reservations.
+/// @param sizes Number of seats of each reservation.
+/// @param xs Array of rows of the seats of every reservation, one reservation after the other.
+/// @param ys Array of columns of the seats of every reservation, one reservation after the other.
+/// @param results Set to 0 for each reservation that was created, 1 for each one that was not.
+/// @return 0 if the event was found, whether or not its reservations were created, 1 otherwise,
+/// in which case every result is 1.
+int ems_reserve_batch(unsigned int event_id, size_t num_reservations, const size_t *sizes, size_t *xs, size_t *ys,
+                      int *results);
+
 /// Prints the given event.
 /// @param event_id Id of the event to print.
+/// @param out Buffer the seats are formatted into.
+/// @param sink Where the buffer goes each time it holds about RENDER_FLUSH_BYTES, NULL to keep all of it.
+/// @note If formatting fails partway, the parts already passed to the sink stay passed on,
+/// only what is left in the buffer can be dropped.
 /// @return 0 if the event was printed successfully, 1 otherwise.
-int ems_show(unsigned int event_id, int file_out);
+int ems_show(unsigned int event_id, struct OutputBuffer *out, const struct OutputSink *sink);
 
 /// Prints all the events.
+/// @param out Buffer the events are formatted into.
+/// @param sink Where the buffer goes each time it holds about RENDER_FLUSH_BYTES, NULL to keep all of it.
+/// @note If formatting fails partway, the parts already passed to the sink stay passed on,
+/// only what is left in the buffer can be dropped.
 /// @return 0 if the events were printed successfully, 1 otherwise.
-int ems_list_events(int file_out);
+int ems_list_events(struct OutputBuffer *out, const struct OutputSink *sink);
+
+/// Reports the events and seat locks that were waited for the longest.
+/// @note Only events created while lock profiling was on are reported.
+/// @param out Buffer the report is formatted into.
+/// @param top Maximum number of events, and of locks, to report.
+/// @return 0 if the report was formatted successfully, 1 otherwise.
+int ems_lock_report(struct OutputBuffer *out, size_t top);
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
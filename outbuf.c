@@ -0,0 +1,98 @@
+#include "outbuf.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// "00" "01" ... "99": each pair of digits is copied in one go
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+char* outbuf_reserve(struct OutputBuffer* buffer, size_t count) {
+  if (buffer->len + count > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->len + count) capacity *= 2;
+
+    char* data = realloc(buffer->data, capacity);
+    if (data == NULL) return NULL;
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+
+  return buffer->data + buffer->len;
+}
+
+int outbuf_append(struct OutputBuffer* buffer, const char* str, size_t len) {
+  char* out = outbuf_reserve(buffer, len);
+  if (out == NULL) return 1;
+
+  memcpy(out, str, len);
+  buffer->len += len;
+  return 0;
+}
+
+size_t format_uint(char* out, unsigned int value) {
+  char digits[10];
+  size_t pos = sizeof(digits);
+
+  // Fill from the right, two digits per division
+  while (value >= 100) {
+    unsigned int pair = (value % 100) * 2;
+    value /= 100;
+    digits[--pos] = digit_pairs[pair + 1];
+    digits[--pos] = digit_pairs[pair];
+  }
+  if (value >= 10) {
+    digits[--pos] = digit_pairs[value * 2 + 1];
+    digits[--pos] = digit_pairs[value * 2];
+  } else {
+    digits[--pos] = (char)('0' + value);
+  }
+
+  size_t len = sizeof(digits) - pos;
+  memcpy(out, digits + pos, len);
+  return len;
+}
+
+int write_all(int fd, const char* data, size_t len) {
+  size_t done = 0;
+  while (len > 0) {
+    ssize_t bytes_written = write(fd, data + done, len);
+
+    if (bytes_written < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "write error: %s\n", strerror(errno));
+      return -1;
+    }
+
+    /* might not have managed to write all, len becomes what remains */
+    len -= (size_t)bytes_written;
+    done += (size_t)bytes_written;
+  }
+  return 0;
+}
+
+int outbuf_flush(struct OutputBuffer* buffer, int fd) {
+  int result = write_all(fd, buffer->data, buffer->len);
+  buffer->len = 0;
+  return result;
+}
+
+void outbuf_free(struct OutputBuffer* buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->capacity = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef EMS_OUTBUF_H
+#define EMS_OUTBUF_H
+
+#include <stddef.h>
+
+/// Growable byte buffer that output is formatted into before being written.
+struct OutputBuffer {
+  char* data;
+  size_t len;       /// Bytes formatted so far.
+  size_t capacity;  /// Bytes allocated.
+};
+
+/// Where output goes in parts while it is being formatted, so that huge
+/// output is never held whole.
+struct OutputSink {
+  int (*flush)(void* context, struct OutputBuffer* buffer);  /// Takes the contents of the buffer and empties it,
+                                                             /// returns 0 on success.
+  void* context;
+};
+
+/// Makes room for at least count more bytes.
+/// @param buffer Buffer to be grown.
+/// @param count Number of bytes about to be appended.
+/// @return Pointer to where the next byte goes, NULL on failure.
+char* outbuf_reserve(struct OutputBuffer* buffer, size_t count);
+
+/// Appends a string.
+/// @param buffer Buffer to append to.
+/// @param str String to be appended, without its terminator.
+/// @param len Length of the string.
+/// @return 0 if the string was appended successfully, 1 otherwise.
+int outbuf_append(struct OutputBuffer* buffer, const char* str, size_t len);
+
+/// Formats an unsigned integer in decimal, two digits at a time.
+/// @param out Where the digits go, must have room for 10 bytes.
+/// @param value Value to be formatted.
+/// @return Number of digits written.
+size_t format_uint(char* out, unsigned int value);
+
+/// Writes the whole buffer and empties it.
+/// @param buffer Buffer to be written.
+/// @param fd File descriptor to write to.
+/// @return 0 if everything was written, -1 on a write error.
+int outbuf_flush(struct OutputBuffer* buffer, int fd);
+
+/// Writes len bytes, retrying after partial writes.
+/// @param fd File descriptor to write to.
+/// @param data Bytes to be written.
+/// @param len Number of bytes.
+/// @return 0 if everything was written, -1 on a write error.
+int write_all(int fd, const char* data, size_t len);
+
+/// Frees the memory of a buffer, leaving it empty.
+/// @param buffer Buffer to be freed.
+void outbuf_free(struct OutputBuffer* buffer);
+
+#endif  // EMS_OUTBUF_H
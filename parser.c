@@ -1,35 +1,126 @@
 #include "parser.h"
+#include <errno.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "constants.h"
 
+/// Input is read from the file descriptor in blocks of this size instead of
+/// one byte per read() call.
+#define INPUT_BUFFER_SIZE (64 * 1024)
 
-static int read_uint(int fd, unsigned int *value, char *next) {
-  char buf[16];
+/// Highest file descriptor (exclusive) that can be parsed from.
+#define MAX_INPUT_FDS 1024
+
+/// Number of memory inputs that can be open at once. Their handles are
+/// negative, from -2 down, so they never clash with a file descriptor.
+#define MAX_MEMORY_INPUTS 256
+
+/// Tells whether a handle stands for a memory input.
+#define IS_MEMORY_HANDLE(handle) ((handle) <= -2 && (handle) >= -MAX_MEMORY_INPUTS - 1)
+
+/// Slot of the memory input table a handle stands for.
+#define MEMORY_SLOT(handle) (-(handle) - 2)
+
+struct InputBuffer {
+  int fd;            /// -1 for a memory input, which is never refilled.
+  const char *data;  /// Either block or the memory being parsed.
+  size_t pos;        /// Next unread byte in data.
+  size_t len;        /// Number of valid bytes in data.
+  char block[];      /// Blocks read from fd, INPUT_BUFFER_SIZE bytes.
+};
+
+// One buffer per open file descriptor. Each descriptor is only ever read by
+// the thread that opened it, so the slots need no locking. Memory inputs
+// are claimed by whichever thread opens them, hence the atomic slots.
+static struct InputBuffer *input_buffers[MAX_INPUT_FDS];
+static _Atomic(struct InputBuffer *) memory_inputs[MAX_MEMORY_INPUTS];
+
+static struct InputBuffer *get_input(int fd) {
+  if (IS_MEMORY_HANDLE(fd)) {
+    return atomic_load_explicit(&memory_inputs[MEMORY_SLOT(fd)], memory_order_relaxed);
+  }
+  if (fd < 0 || fd >= MAX_INPUT_FDS) {
+    return NULL;
+  }
+
+  if (input_buffers[fd] == NULL) {
+    struct InputBuffer *in = malloc(sizeof(struct InputBuffer) + INPUT_BUFFER_SIZE);
+    if (in == NULL) {
+      return NULL;
+    }
+    in->fd = fd;
+    in->data = in->block;
+    in->pos = 0;
+    in->len = 0;
+    input_buffers[fd] = in;
+  }
+
+  return input_buffers[fd];
+}
+
+/// Reads the next character, refilling the buffer when it runs out.
+/// @return 1 if a character was read, 0 at end of file or on error.
+static int read_char(struct InputBuffer *in, char *ch) {
+  if (in->pos == in->len) {
+    if (in->fd < 0) {
+      return 0;
+    }
+
+    ssize_t bytes_read;
+    do {
+      bytes_read = read(in->fd, in->block, INPUT_BUFFER_SIZE);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read <= 0) {
+      return 0;
+    }
+    in->pos = 0;
+    in->len = (size_t)bytes_read;
+  }
+
+  *ch = in->data[in->pos++];
+  return 1;
+}
+
+/// Reads up to count characters.
+/// @return Number of characters read.
+static size_t read_chars(struct InputBuffer *in, char *buf, size_t count) {
+  size_t i = 0;
+  while (i < count && read_char(in, buf + i) == 1) {
+    i++;
+  }
+  return i;
+}
+
+static int read_uint(struct InputBuffer *in, unsigned int *value, char *next) {
+  unsigned long ul = 0;
+  int overflow = 0;
 
-  int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    char ch;
+    if (read_char(in, &ch) == 0) {
       *next = '\0';
       break;
     }
 
-    *next = buf[i];
+    *next = ch;
 
-    if (buf[i] > '9' || buf[i] < '0') {
-      buf[i] = '\0';
+    if (ch > '9' || ch < '0') {
       break;
     }
 
-    i++;
+    ul = ul * 10 + (unsigned long)(ch - '0');
+    if (ul > UINT_MAX) {
+      overflow = 1;
+      ul = 0;
+    }
   }
 
-  unsigned long ul = strtoul(buf, NULL, 10);
-
-  if (ul > UINT_MAX) {
+  if (overflow) {
     return 1;
   }
 
@@ -38,122 +129,163 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-static void cleanup(int fd) {
+static void cleanup(struct InputBuffer *in) {
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (read_char(in, &ch) == 1 && ch != '\n')
     ;
 }
 
+int parser_open_memory(const char *data, size_t len) {
+  struct InputBuffer *in = malloc(sizeof(struct InputBuffer));
+  if (in == NULL) {
+    return -1;
+  }
+  in->fd = -1;
+  in->data = data;
+  in->pos = 0;
+  in->len = len;
+
+  for (int i = 0; i < MAX_MEMORY_INPUTS; i++) {
+    struct InputBuffer *expected = NULL;
+    if (atomic_compare_exchange_strong(&memory_inputs[i], &expected, in)) {
+      return -i - 2;
+    }
+  }
+  free(in);
+  return -1;
+}
+
+int parser_open(int fd) {
+  return get_input(fd) == NULL;
+}
+
+void parser_release(int fd) {
+  if (IS_MEMORY_HANDLE(fd)) {
+    free(atomic_exchange(&memory_inputs[MEMORY_SLOT(fd)], NULL));
+    return;
+  }
+  if (fd < 0 || fd >= MAX_INPUT_FDS) {
+    return;
+  }
+
+  free(input_buffers[fd]);
+  input_buffers[fd] = NULL;
+}
+
 enum Command get_next(int fd) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  struct InputBuffer *in = get_input(fd);
+  if (in == NULL || read_char(in, buf) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'C':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "CREATE ", 7) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 6) != 6 || strncmp(buf, "CREATE ", 7) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_CREATE;
 
     case 'R':
-      if (read(fd, buf + 1, 7) != 7 || strncmp(buf, "RESERVE ", 8) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 7) != 7 || strncmp(buf, "RESERVE ", 8) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_RESERVE;
 
     case 'S':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "SHOW ", 5) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 4) != 4 || strncmp(buf, "SHOW ", 5) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_SHOW;
 
     case 'L':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "LIST", 4) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 3) != 3 || strncmp(buf, "LIST", 4) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (read_char(in, buf + 4) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_LIST_EVENTS;
 
     case 'B':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "BARRIER", 7) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 6) != 6 || strncmp(buf, "BARRIER", 7) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 7, 1) != 0 && buf[7] != '\n') {
-        cleanup(fd);
+      if (read_char(in, buf + 7) != 0 && buf[7] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_BARRIER;
 
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_WAIT;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (read_char(in, buf + 4) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_HELP;
 
     case '#':
-      cleanup(fd);
+      cleanup(in);
       return CMD_EMPTY;
 
     case '\n':
       return CMD_EMPTY;
 
     default:
-      cleanup(fd);
+      cleanup(in);
       return CMD_INVALID;
   }
 }
 
 int parse_create(int fd, unsigned int *event_id, size_t *num_rows, size_t *num_cols) {
   char ch;
-  
+  struct InputBuffer *in = get_input(fd);
+  if (in == NULL) {
+    return 1;
+  }
 
-  if (read_uint(fd, event_id, &ch) != 0 || ch != ' ') {
-    cleanup(fd);
+  if (read_uint(in, event_id, &ch) != 0 || ch != ' ') {
+    cleanup(in);
     return 1;
   }
 
   unsigned int u_num_rows;
-  if (read_uint(fd, &u_num_rows, &ch) != 0 || ch != ' ') {
-    cleanup(fd);
+  if (read_uint(in, &u_num_rows, &ch) != 0 || ch != ' ') {
+    cleanup(in);
     return 1;
   }
   *num_rows = (size_t)u_num_rows;
 
   unsigned int u_num_cols;
-  if (read_uint(fd, &u_num_cols, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (read_uint(in, &u_num_cols, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 1;
   }
   *num_cols = (size_t)u_num_cols;
@@ -161,70 +293,94 @@ int parse_create(int fd, unsigned int *event_id, size_t *num_rows, size_t *num_c
   return 0;
 }
 
-size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs, size_t *ys) {
+size_t parse_reserve_batch(int fd, size_t max, size_t max_reservations, unsigned int *event_id, size_t *xs,
+                           size_t *ys, size_t *sizes, size_t *num_reservations) {
   char ch;
-
-  if (read_uint(fd, event_id, &ch) != 0 || ch != ' ') {
-    cleanup(fd);
+  struct InputBuffer *in = get_input(fd);
+  if (in == NULL) {
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (read_uint(in, event_id, &ch) != 0 || ch != ' ') {
+    cleanup(in);
     return 0;
   }
 
   size_t num_coords = 0;
-  while (num_coords < max) {
-    if (read(fd, &ch, 1) != 1 || ch != '(') {
-      cleanup(fd);
+  *num_reservations = 0;
+  for (;;) {
+    if (*num_reservations == max_reservations || read_char(in, &ch) != 1 || ch != '[') {
+      // After a trailing space, the end of the line may have been read already
+      if (*num_reservations == 0 || ch != '\n') cleanup(in);
       return 0;
     }
 
-    unsigned int x;
-    if (read_uint(fd, &x, &ch) != 0 || ch != ',') {
-      cleanup(fd);
-      return 0;
+    size_t first = num_coords;
+    while (num_coords < max && num_coords - first < MAX_RESERVATION_SIZE) {
+      if (read_char(in, &ch) != 1 || ch != '(') {
+        cleanup(in);
+        return 0;
+      }
+
+      unsigned int x;
+      if (read_uint(in, &x, &ch) != 0 || ch != ',') {
+        cleanup(in);
+        return 0;
+      }
+      xs[num_coords] = (size_t)x;
+
+      unsigned int y;
+      if (read_uint(in, &y, &ch) != 0 || ch != ')') {
+        cleanup(in);
+        return 0;
+      }
+      ys[num_coords] = (size_t)y;
+
+      num_coords++;
+
+      if (read_char(in, &ch) != 1 || (ch != ' ' && ch != ']')) {
+        cleanup(in);
+        return 0;
+      }
+
+      if (ch == ']') {
+        break;
+      }
     }
-    xs[num_coords] = (size_t)x;
 
-    unsigned int y;
-    if (read_uint(fd, &y, &ch) != 0 || ch != ')') {
-      cleanup(fd);
+    if (num_coords == max || num_coords - first == MAX_RESERVATION_SIZE) {
+      cleanup(in);
       return 0;
     }
-    ys[num_coords] = (size_t)y;
+    sizes[(*num_reservations)++] = num_coords - first;
 
-    num_coords++;
-
-    if (read(fd, &ch, 1) != 1 || (ch != ' ' && ch != ']')) {
-      cleanup(fd);
+    // Another reservation follows after a space
+    if (read_char(in, &ch) != 1 || (ch != ' ' && ch != '\n' && ch != '\0')) {
+      cleanup(in);
       return 0;
     }
-
-    if (ch == ']') {
+    if (ch != ' ') {
       break;
     }
   }
 
-  if (num_coords == max) {
-    cleanup(fd);
-    return 0;
-  }
-
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
-    return 0;
-  }
-
   return num_coords;
 }
 
+size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs, size_t *ys) {
+  size_t size, num_reservations;
+  return parse_reserve_batch(fd, max, 1, event_id, xs, ys, &size, &num_reservations);
+}
+
 int parse_show(int fd, unsigned int *event_id) {
   char ch;
+  struct InputBuffer *in = get_input(fd);
+  if (in == NULL) {
+    return 1;
+  }
 
-  if (read_uint(fd, event_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (read_uint(in, event_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 1;
   }
 
@@ -233,26 +389,30 @@ int parse_show(int fd, unsigned int *event_id) {
 
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   char ch;
+  struct InputBuffer *in = get_input(fd);
+  if (in == NULL) {
+    return -1;
+  }
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(in, delay, &ch) != 0) {
+    cleanup(in);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(in, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(in);
       return -1;
     }
     return 1;
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);    
+    cleanup(in);    
     return -1;
   }
-}
\ No newline at end of file
+}
@@ -16,6 +16,25 @@ enum Command {
   EOC  // End of commands
 };
 
+/// Opens a block of memory for parsing, to be read in place.
+/// @note The memory must stay valid until the handle is released.
+/// @param data Text to parse.
+/// @param len Length of the text, in bytes.
+/// @return Handle to pass in place of a file descriptor, below -1, or -1 on failure.
+int parser_open_memory(const char *data, size_t len);
+
+/// Sets up the input buffer of a file descriptor, if it has none yet.
+/// @param fd File descriptor or memory handle to be parsed.
+/// @return 0 if it can be parsed, 1 if the descriptor is beyond the ones the
+/// parser buffers input for or memory ran out.
+int parser_open(int fd);
+
+/// Drops the input buffered for a file descriptor.
+/// @note Must be called before the file descriptor is closed, since input is
+/// read ahead in blocks and a reused descriptor would otherwise see stale data.
+/// @param fd File descriptor or memory handle that was being parsed.
+void parser_release(int fd);
+
 /// Reads a line and returns the corresponding command.
 /// @param fd File descriptor to read from.
 /// @return The command read.
@@ -38,6 +57,20 @@ int parse_create(int fd, unsigned int *event_id, size_t *num_rows, size_t *num_c
 /// @return Number of coordinates read. 0 on failure.
 size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs, size_t *ys);
 
+/// Parses a RESERVE command that may hold several reservations, each in
+/// its own brackets: RESERVE <event_id> [(<x>,<y>) ...] [(<x>,<y>) ...] ...
+/// @param fd File descriptor to read from.
+/// @param max Maximum number of coordinates to read, over all reservations.
+/// @param max_reservations Maximum number of reservations to read.
+/// @param event_id Pointer to the variable to store the event ID in.
+/// @param xs Pointer to the array to store the X coordinates of every reservation in, back to back.
+/// @param ys Pointer to the array to store the Y coordinates of every reservation in, back to back.
+/// @param sizes Pointer to the array to store the number of coordinates of each reservation in.
+/// @param num_reservations Pointer to the variable to store the number of reservations in.
+/// @return Number of coordinates read. 0 on failure.
+size_t parse_reserve_batch(int fd, size_t max, size_t max_reservations, unsigned int *event_id, size_t *xs,
+                           size_t *ys, size_t *sizes, size_t *num_reservations);
+
 /// Parses a SHOW command.
 /// @param fd File descriptor to read from.
 /// @param event_id Pointer to the variable to store the event ID in.
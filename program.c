@@ -0,0 +1,338 @@
+#include "program.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+
+static struct Instruction* append_instruction(struct Program* program, enum Command command) {
+  if (program->count == program->capacity) {
+    size_t capacity = program->capacity ? program->capacity * 2 : 64;
+    struct Instruction* instructions = realloc(program->instructions, capacity * sizeof(struct Instruction));
+    if (instructions == NULL) return NULL;
+
+    program->instructions = instructions;
+    program->capacity = capacity;
+  }
+
+  struct Instruction* instruction = &program->instructions[program->count++];
+  instruction->command = command;
+  instruction->event_id = 0;
+  instruction->args[0] = 0;
+  instruction->args[1] = 0;
+  instruction->first_seat = 0;
+  instruction->num_seats = 0;
+  return instruction;
+}
+
+static int append_seats(struct Program* program, size_t num_seats, size_t* xs, size_t* ys) {
+  if (program->num_seats + num_seats > program->seats_capacity) {
+    size_t capacity = program->seats_capacity ? program->seats_capacity : 256;
+    while (capacity < program->num_seats + num_seats) capacity *= 2;
+
+    unsigned int* new_xs = realloc(program->xs, capacity * sizeof(unsigned int));
+    if (new_xs == NULL) return 1;
+    program->xs = new_xs;
+
+    unsigned int* new_ys = realloc(program->ys, capacity * sizeof(unsigned int));
+    if (new_ys == NULL) return 1;
+    program->ys = new_ys;
+
+    program->seats_capacity = capacity;
+  }
+
+  // The parser reads every coordinate as an unsigned int, so narrowing is lossless.
+  for (size_t i = 0; i < num_seats; i++) {
+    program->xs[program->num_seats + i] = (unsigned int)xs[i];
+    program->ys[program->num_seats + i] = (unsigned int)ys[i];
+  }
+  program->num_seats += num_seats;
+
+  return 0;
+}
+
+/// Makes room for more reservation sizes in the size pool.
+static int grow_sizes(struct Program* program, size_t extra) {
+  if (program->num_sizes + extra > program->sizes_capacity) {
+    size_t capacity = program->sizes_capacity ? program->sizes_capacity : 64;
+    while (capacity < program->num_sizes + extra) capacity *= 2;
+
+    unsigned int* new_sizes = realloc(program->sizes, capacity * sizeof(unsigned int));
+    if (new_sizes == NULL) return 1;
+    program->sizes = new_sizes;
+    program->sizes_capacity = capacity;
+  }
+  return 0;
+}
+
+static int append_sizes(struct Program* program, size_t num_reservations, size_t* sizes) {
+  if (grow_sizes(program, num_reservations) != 0) return 1;
+
+  // Each size is below MAX_RESERVATION_SIZE, so narrowing is lossless.
+  for (size_t i = 0; i < num_reservations; i++) {
+    program->sizes[program->num_sizes + i] = (unsigned int)sizes[i];
+  }
+  program->num_sizes += num_reservations;
+  return 0;
+}
+
+struct Program* program_parse(int fd) {
+  if (parser_open(fd) != 0) {
+    fprintf(stderr, "Cannot read commands from file descriptor %d\n", fd);
+    return NULL;
+  }
+
+  struct Program* program = calloc(1, sizeof(struct Program));
+  if (program == NULL) return NULL;
+
+  enum Command cmd;
+  while ((cmd = get_next(fd)) != EOC) {
+    unsigned int event_id, delay, thread_id;
+    size_t num_rows, num_columns, num_coords, num_reservations;
+    size_t xs[MAX_BATCH_SEATS], ys[MAX_BATCH_SEATS], sizes[MAX_BATCH_SIZE];
+    struct Instruction* instruction;
+    int has_thread_id;
+
+    switch (cmd) {
+      case CMD_CREATE:
+        if (parse_create(fd, &event_id, &num_rows, &num_columns) != 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if ((instruction = append_instruction(program, cmd)) == NULL) goto fail;
+        instruction->event_id = event_id;
+        instruction->args[0] = (unsigned int)num_rows;
+        instruction->args[1] = (unsigned int)num_columns;
+        break;
+
+      case CMD_RESERVE:
+        num_coords = parse_reserve_batch(fd, MAX_BATCH_SEATS, MAX_BATCH_SIZE, &event_id, xs, ys, sizes, &num_reservations);
+
+        if (num_coords == 0) {
+          fprintf(stderr, "Failed Reserve. Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if ((instruction = append_instruction(program, cmd)) == NULL) goto fail;
+        instruction->event_id = event_id;
+        instruction->args[0] = (unsigned int)num_reservations;
+        instruction->first_seat = program->num_seats;
+        instruction->num_seats = num_coords;
+        if (append_seats(program, num_coords, xs, ys) != 0) goto fail;
+        if (num_reservations > 1) {
+          instruction->args[1] = (unsigned int)program->num_sizes;
+          if (append_sizes(program, num_reservations, sizes) != 0) goto fail;
+        }
+        break;
+
+      case CMD_SHOW:
+        if (parse_show(fd, &event_id) != 0) {
+          fprintf(stderr, "Failed Show. Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if ((instruction = append_instruction(program, cmd)) == NULL) goto fail;
+        instruction->event_id = event_id;
+        break;
+
+      case CMD_WAIT:
+        thread_id = 0;
+        has_thread_id = parse_wait(fd, &delay, &thread_id);
+        if (has_thread_id == -1) {
+          fprintf(stderr, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if ((instruction = append_instruction(program, cmd)) == NULL) goto fail;
+        instruction->args[0] = delay;
+        instruction->args[1] = has_thread_id ? thread_id : 0;
+        break;
+
+      case CMD_INVALID:
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        break;
+
+      case CMD_LIST_EVENTS:
+      case CMD_HELP:
+      case CMD_BARRIER:
+        if (append_instruction(program, cmd) == NULL) goto fail;
+        break;
+
+      case CMD_EMPTY:
+        break;
+
+      case EOC:
+        break;
+    }
+  }
+
+  return program;
+
+fail:
+  fprintf(stderr, "Memory allocation error\n");
+  program_free(program);
+  return NULL;
+}
+
+/// Smallest chunk worth a parsing thread of its own.
+#define MIN_PARSE_CHUNK (1024 * 1024)
+
+/// Part of a job file parsed by one thread.
+struct ParseChunk {
+  const char* data;
+  size_t len;
+  struct Program* segment;  /// Instructions of the chunk, NULL if parsing failed.
+};
+
+static void* parse_chunk(void* arg) {
+  struct ParseChunk* chunk = arg;
+  int handle = parser_open_memory(chunk->data, chunk->len);
+  if (handle == -1) {
+    fprintf(stderr, "Too many inputs being parsed at once\n");
+    chunk->segment = NULL;
+    return NULL;
+  }
+  chunk->segment = program_parse(handle);
+  parser_release(handle);
+  return NULL;
+}
+
+/// Appends the instructions and seats of a segment to a program, rebasing its seat indexes.
+static int append_segment(struct Program* program, const struct Program* segment) {
+  if (program->count + segment->count > program->capacity) {
+    size_t capacity = program->capacity ? program->capacity : 64;
+    while (capacity < program->count + segment->count) capacity *= 2;
+    struct Instruction* instructions = realloc(program->instructions, capacity * sizeof(struct Instruction));
+    if (instructions == NULL) return 1;
+
+    program->instructions = instructions;
+    program->capacity = capacity;
+  }
+  if (program->num_seats + segment->num_seats > program->seats_capacity) {
+    size_t capacity = program->seats_capacity ? program->seats_capacity : 256;
+    while (capacity < program->num_seats + segment->num_seats) capacity *= 2;
+
+    unsigned int* new_xs = realloc(program->xs, capacity * sizeof(unsigned int));
+    if (new_xs == NULL) return 1;
+    program->xs = new_xs;
+
+    unsigned int* new_ys = realloc(program->ys, capacity * sizeof(unsigned int));
+    if (new_ys == NULL) return 1;
+    program->ys = new_ys;
+
+    program->seats_capacity = capacity;
+  }
+
+  for (size_t i = 0; i < segment->count; i++) {
+    struct Instruction* instruction = &program->instructions[program->count + i];
+    *instruction = segment->instructions[i];
+    instruction->first_seat += program->num_seats;
+    if (instruction->command == CMD_RESERVE && instruction->args[0] > 1) {
+      instruction->args[1] += (unsigned int)program->num_sizes;
+    }
+  }
+  program->count += segment->count;
+
+  if (segment->num_sizes > 0) {
+    if (grow_sizes(program, segment->num_sizes) != 0) return 1;
+    memcpy(program->sizes + program->num_sizes, segment->sizes, segment->num_sizes * sizeof(unsigned int));
+    program->num_sizes += segment->num_sizes;
+  }
+
+  if (segment->num_seats > 0) {
+    memcpy(program->xs + program->num_seats, segment->xs, segment->num_seats * sizeof(unsigned int));
+    memcpy(program->ys + program->num_seats, segment->ys, segment->num_seats * sizeof(unsigned int));
+    program->num_seats += segment->num_seats;
+  }
+  return 0;
+}
+
+struct Program* program_parse_chunked(const char* data, size_t len, int max_threads) {
+  size_t num_chunks = len / MIN_PARSE_CHUNK;
+  if (num_chunks > (size_t)max_threads) num_chunks = (size_t)max_threads;
+  if (num_chunks == 0) num_chunks = 1;
+
+  struct ParseChunk* chunks = calloc(num_chunks, sizeof(struct ParseChunk));
+  pthread_t* tids = calloc(num_chunks, sizeof(pthread_t));
+  if (chunks == NULL || tids == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    free(chunks);
+    free(tids);
+    return NULL;
+  }
+
+  // Cut roughly equal chunks, each ending just after a newline so that no
+  // command is split. A chunk may end up empty if a line spans several.
+  size_t start = 0;
+  for (size_t i = 0; i < num_chunks; i++) {
+    size_t end = i + 1 == num_chunks ? len : len / num_chunks * (i + 1);
+    if (end < start) end = start;
+    const char* newline = end < len ? memchr(data + end, '\n', len - end) : NULL;
+    if (end < len) end = newline ? (size_t)(newline - data) + 1 : len;
+
+    chunks[i].data = data + start;
+    chunks[i].len = end - start;
+    start = end;
+  }
+
+  // The first chunk is parsed by the calling thread
+  size_t started = 1;
+  for (; started < num_chunks; started++) {
+    if (pthread_create(&tids[started], NULL, parse_chunk, &chunks[started]) != 0) break;
+  }
+  parse_chunk(&chunks[0]);
+  for (size_t i = started; i < num_chunks; i++) {
+    parse_chunk(&chunks[i]);
+  }
+  for (size_t i = 1; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  // Segments are joined in file order, so BARRIERs keep their place
+  struct Program* program = calloc(1, sizeof(struct Program));
+  int failed = program == NULL;
+  if (failed) fprintf(stderr, "Memory allocation error\n");
+  for (size_t i = 0; i < num_chunks; i++) {
+    if (chunks[i].segment == NULL) {
+      failed = 1;
+    } else if (!failed && append_segment(program, chunks[i].segment) != 0) {
+      fprintf(stderr, "Memory allocation error\n");
+      failed = 1;
+    }
+    program_free(chunks[i].segment);
+  }
+  free(chunks);
+  free(tids);
+
+  if (failed) {
+    program_free(program);
+    return NULL;
+  }
+  return program;
+}
+
+void program_seats(const struct Program* program, const struct Instruction* instruction, size_t* xs, size_t* ys) {
+  for (size_t i = 0; i < instruction->num_seats; i++) {
+    xs[i] = program->xs[instruction->first_seat + i];
+    ys[i] = program->ys[instruction->first_seat + i];
+  }
+}
+
+void program_sizes(const struct Program* program, const struct Instruction* instruction, size_t* sizes) {
+  for (size_t i = 0; i < instruction->args[0]; i++) {
+    sizes[i] = program->sizes[instruction->args[1] + i];
+  }
+}
+
+void program_free(struct Program* program) {
+  if (!program) return;
+
+  free(program->instructions);
+  free(program->xs);
+  free(program->ys);
+  free(program->sizes);
+  free(program);
+}
@@ -0,0 +1,67 @@
+#ifndef EMS_PROGRAM_H
+#define EMS_PROGRAM_H
+
+#include <stddef.h>
+
+#include "parser.h"
+
+/// A decoded command of a job file.
+struct Instruction {
+  enum Command command;
+  unsigned int event_id;  /// Event id for CREATE, RESERVE and SHOW.
+  unsigned int args[2];   /// Rows and columns for CREATE, delay and thread id (0 if none) for WAIT,
+                          /// number of reservations (1 unless batched) and index of their sizes for RESERVE.
+  size_t first_seat;      /// Index of the first seat of a RESERVE in the coordinate pool.
+  size_t num_seats;       /// Number of seats of a RESERVE, over all of its reservations.
+};
+
+/// A job file parsed once into a flat array of instructions.
+/// Seats of every RESERVE are stored back to back in a single coordinate pool.
+struct Program {
+  struct Instruction* instructions;
+  size_t count;
+  size_t capacity;
+
+  unsigned int* xs;  /// Rows of all the reserved seats.
+  unsigned int* ys;  /// Columns of all the reserved seats.
+  size_t num_seats;
+  size_t seats_capacity;
+
+  unsigned int* sizes;  /// Number of seats of each reservation of the batched RESERVEs.
+  size_t num_sizes;
+  size_t sizes_capacity;
+};
+
+/// Parses every command of a job file.
+/// @note Invalid commands are reported to stderr and left out of the program.
+/// @param fd File descriptor to read from.
+/// @return Newly created program, NULL on failure.
+struct Program* program_parse(int fd);
+
+/// Parses a job file held in memory, splitting it at line boundaries into
+/// chunks that are parsed by separate threads and joined back in order.
+/// @note Invalid commands are reported to stderr and left out of the program.
+/// @param data Contents of the job file, e.g. mapped with mmap.
+/// @param len Length of the contents, in bytes.
+/// @param max_threads Maximum number of parsing threads.
+/// @return Newly created program, NULL on failure.
+struct Program* program_parse_chunked(const char* data, size_t len, int max_threads);
+
+/// Copies the seats of a RESERVE instruction out of the coordinate pool.
+/// @param program Program the instruction belongs to.
+/// @param instruction RESERVE instruction.
+/// @param xs Array to store the rows in, with room for num_seats entries.
+/// @param ys Array to store the columns in, with room for num_seats entries.
+void program_seats(const struct Program* program, const struct Instruction* instruction, size_t* xs, size_t* ys);
+
+/// Copies the number of seats of each reservation of a batched RESERVE instruction.
+/// @param program Program the instruction belongs to.
+/// @param instruction RESERVE instruction with more than one reservation.
+/// @param sizes Array to store the sizes in, with room for args[0] entries.
+void program_sizes(const struct Program* program, const struct Instruction* instruction, size_t* sizes);
+
+/// Frees a program.
+/// @param program Program to be freed.
+void program_free(struct Program* program);
+
+#endif  // EMS_PROGRAM_H
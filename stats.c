@@ -0,0 +1,324 @@
+// MAP_ANONYMOUS is not part of POSIX.1-2008
+#define _DEFAULT_SOURCE
+
+#include "stats.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "outbuf.h"
+
+/// Histograms keep 2^SUB_BUCKET_BITS linear buckets per power of two, so a
+/// bucket is never wider than 1/16 of the values it holds, as in HdrHistogram.
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+/// Largest power of two tracked, about 18 minutes in nanoseconds.
+#define MAX_EXPONENT 40
+#define NUM_BUCKETS ((MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS)
+
+struct CommandMetrics {
+  atomic_ulong count;
+  atomic_ulong total_ns;
+  atomic_ulong max_ns;
+  atomic_ulong state_accesses;    /// Made while running commands of this type.
+  atomic_ulong state_access_ns;   /// Time those accesses spent in the simulated delay.
+  atomic_ulong buckets[NUM_BUCKETS];
+};
+
+/// Lives in a shared mapping, filled in by every process.
+struct Metrics {
+  uint64_t start_ns;
+  struct CommandMetrics commands[EOC];
+  atomic_ulong timers[NUM_TIMERS];
+};
+
+static struct Metrics* metrics = NULL;
+static int lock_profiling = 0;
+
+// State accesses of the command the thread is running, added to the
+// shared counters once per command rather than once per access
+static _Thread_local uint64_t pending_accesses = 0;
+static _Thread_local uint64_t pending_access_ns = 0;
+
+static const char* const command_names[EOC] = {
+    [CMD_CREATE] = "CREATE", [CMD_RESERVE] = "RESERVE", [CMD_SHOW] = "SHOW",
+    [CMD_LIST_EVENTS] = "LIST", [CMD_BARRIER] = "BARRIER", [CMD_WAIT] = "WAIT",
+    [CMD_HELP] = "HELP", [CMD_EMPTY] = "EMPTY", [CMD_INVALID] = "INVALID",
+};
+
+static const char* const timer_names[NUM_TIMERS] = {
+    [TIMER_PARSE] = "parse",
+    [TIMER_OUTPUT] = "output",
+};
+
+int latency_record(struct LatencySamples* samples, double us) {
+  if (samples->count == samples->capacity) {
+    size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+    double* values = realloc(samples->values, capacity * sizeof(double));
+    if (values == NULL) return 1;
+
+    samples->values = values;
+    samples->capacity = capacity;
+  }
+
+  samples->values[samples->count++] = us;
+  return 0;
+}
+
+int latency_merge(struct LatencySamples* samples, const struct LatencySamples* other) {
+  for (size_t i = 0; i < other->count; i++) {
+    if (latency_record(samples, other->values[i]) != 0) return 1;
+  }
+  return 0;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double da = *(const double*)a, db = *(const double*)b;
+  return (da > db) - (da < db);
+}
+
+double latency_percentile(struct LatencySamples* samples, double pct) {
+  if (samples->count == 0) return 0;
+
+  qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+  size_t rank = (size_t)(pct / 100.0 * (double)samples->count);
+  if (rank >= samples->count) rank = samples->count - 1;
+  return samples->values[rank];
+}
+
+void latency_free(struct LatencySamples* samples) {
+  free(samples->values);
+  samples->values = NULL;
+  samples->count = 0;
+  samples->capacity = 0;
+}
+
+/// Appends formatted text to a buffer.
+/// @return 0 if the text was appended, 1 otherwise.
+static int append_format(struct OutputBuffer* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static int append_format(struct OutputBuffer* out, const char* format, ...) {
+  char text[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if (len < 0 || (size_t)len >= sizeof(text)) return 1;
+  return outbuf_append(out, text, (size_t)len);
+}
+
+/// Appends a string as the contents of a JSON string, escaping quotes,
+/// backslashes and control characters.
+static int append_json_string(struct OutputBuffer* out, const char* str) {
+  int failed = 0;
+  for (const char* c = str; *c != '\0' && !failed; c++) {
+    if (*c == '"' || *c == '\\') {
+      char escaped[2] = {'\\', *c};
+      failed = outbuf_append(out, escaped, 2);
+    } else if ((unsigned char)*c < 0x20) {
+      failed = append_format(out, "\\u%04x", (unsigned int)(unsigned char)*c);
+    } else {
+      failed = outbuf_append(out, c, 1);
+    }
+  }
+  return failed;
+}
+
+int stats_write(int fd, const char* job, int threads, double wall_ms, struct LatencySamples* samples) {
+  struct OutputBuffer line = {NULL, 0, 0};
+  double p50 = latency_percentile(samples, 50);
+  double p99 = latency_percentile(samples, 99);
+  double max = samples->count ? samples->values[samples->count - 1] : 0;
+
+  int failed = outbuf_append(&line, "{\"job\":\"", strlen("{\"job\":\"")) || append_json_string(&line, job) ||
+               append_format(&line,
+                             "\",\"threads\":%d,\"commands\":%zu,\"wall_ms\":%.3f,\"commands_per_sec\":%.1f,"
+                             "\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+                             threads, samples->count, wall_ms,
+                             wall_ms > 0 ? (double)samples->count * 1000.0 / wall_ms : 0.0, p50, p99, max);
+  if (!failed) {
+    failed = write_all(fd, line.data, line.len) != 0;
+  }
+  outbuf_free(&line);
+  return failed;
+}
+
+static size_t bucket_of(uint64_t ns) {
+  if (ns < SUB_BUCKETS) return (size_t)ns;
+
+  int exponent = 63 - __builtin_clzll(ns);
+  if (exponent > MAX_EXPONENT) return NUM_BUCKETS - 1;
+  size_t sub = (size_t)(ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  return (size_t)(exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/// @return Highest value that falls in a bucket.
+static uint64_t bucket_limit(size_t bucket) {
+  if (bucket < SUB_BUCKETS) return bucket;
+
+  int shift = (int)(bucket / SUB_BUCKETS) - 1;
+  uint64_t sub = bucket % SUB_BUCKETS;
+  return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+int metrics_init(void) {
+  void* mapping = mmap(NULL, sizeof(struct Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  // A fresh anonymous mapping is zeroed, which is a valid state for the atomics
+  metrics = mapping;
+  metrics->start_ns = metrics_now_ns();
+  return 0;
+}
+
+int metrics_enabled(void) { return metrics != NULL; }
+
+uint64_t metrics_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void metrics_record_command(enum Command command, uint64_t ns) {
+  if (metrics == NULL || command >= EOC) return;
+
+  struct CommandMetrics* m = &metrics->commands[command];
+  atomic_fetch_add_explicit(&m->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&m->total_ns, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&m->buckets[bucket_of(ns)], 1, memory_order_relaxed);
+
+  unsigned long max = atomic_load_explicit(&m->max_ns, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(&m->max_ns, &max, ns, memory_order_relaxed,
+                                                            memory_order_relaxed))
+    ;
+
+  if (pending_accesses > 0) {
+    atomic_fetch_add_explicit(&m->state_accesses, pending_accesses, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->state_access_ns, pending_access_ns, memory_order_relaxed);
+    pending_accesses = 0;
+    pending_access_ns = 0;
+  }
+}
+
+void metrics_record_state_access(uint64_t ns) {
+  pending_accesses++;
+  pending_access_ns += ns;
+}
+
+void metrics_add_time(enum MetricsTimer timer, uint64_t ns) {
+  if (metrics == NULL) return;
+  atomic_fetch_add_explicit(&metrics->timers[timer], ns, memory_order_relaxed);
+}
+
+/// @return The value below which pct percent of the histogram falls.
+static uint64_t histogram_percentile(const uint64_t* counts, uint64_t total, double pct) {
+  uint64_t rank = (uint64_t)(pct / 100.0 * (double)total);
+  if (rank >= total) rank = total - 1;
+
+  uint64_t seen = 0;
+  for (size_t b = 0; b < NUM_BUCKETS; b++) {
+    seen += counts[b];
+    if (seen > rank) return bucket_limit(b);
+  }
+  return bucket_limit(NUM_BUCKETS - 1);
+}
+
+int metrics_dump(int fd) {
+  if (metrics == NULL) return 1;
+
+  struct OutputBuffer out = {NULL, 0, 0};
+  uint64_t counts[NUM_BUCKETS];
+  int failed = append_format(&out, "{\"uptime_ms\":%.3f,\"commands\":{", (double)(metrics_now_ns() - metrics->start_ns) / 1e6);
+
+  int first = 1;
+  for (int c = 0; c < EOC; c++) {
+    struct CommandMetrics* m = &metrics->commands[c];
+    uint64_t total = 0;
+    // Counters keep moving while the dump is made, the histogram is the reference
+    for (size_t b = 0; b < NUM_BUCKETS; b++) {
+      counts[b] = atomic_load_explicit(&m->buckets[b], memory_order_relaxed);
+      total += counts[b];
+    }
+    if (total == 0) continue;
+
+    uint64_t total_ns = atomic_load_explicit(&m->total_ns, memory_order_relaxed);
+    uint64_t access_ns = atomic_load_explicit(&m->state_access_ns, memory_order_relaxed);
+    failed |= append_format(&out,
+                            "%s\"%s\":{\"count\":%lu,\"total_us\":%.3f,\"state_accesses\":%lu,"
+                            "\"state_access_us\":%.3f,\"work_us\":%.3f,",
+                            first ? "" : ",", command_names[c], (unsigned long)total, (double)total_ns / 1e3,
+                            atomic_load_explicit(&m->state_accesses, memory_order_relaxed), (double)access_ns / 1e3,
+                            total_ns > access_ns ? (double)(total_ns - access_ns) / 1e3 : 0.0);
+    failed |= append_format(&out, "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,\"buckets\":[",
+                            (double)histogram_percentile(counts, total, 50) / 1e3,
+                            (double)histogram_percentile(counts, total, 90) / 1e3,
+                            (double)histogram_percentile(counts, total, 99) / 1e3,
+                            (double)atomic_load_explicit(&m->max_ns, memory_order_relaxed) / 1e3);
+    // [highest value of the bucket in ns, count], empty buckets left out
+    int first_bucket = 1;
+    for (size_t b = 0; b < NUM_BUCKETS; b++) {
+      if (counts[b] == 0) continue;
+      failed |= append_format(&out, "%s[%lu,%lu]", first_bucket ? "" : ",", (unsigned long)bucket_limit(b),
+                              (unsigned long)counts[b]);
+      first_bucket = 0;
+    }
+    failed |= append_format(&out, "]}");
+    first = 0;
+  }
+
+  failed |= append_format(&out, "},\"timers_us\":{");
+  for (int t = 0; t < NUM_TIMERS; t++) {
+    failed |= append_format(&out, "%s\"%s\":%.3f", t ? "," : "", timer_names[t],
+                            (double)atomic_load_explicit(&metrics->timers[t], memory_order_relaxed) / 1e3);
+  }
+  failed |= append_format(&out, "}}\n");
+
+  if (!failed) failed = outbuf_flush(&out, fd) != 0;
+  outbuf_free(&out);
+  return failed;
+}
+
+void lock_profiling_enable(void) { lock_profiling = 1; }
+
+int lock_profiling_enabled(void) { return lock_profiling; }
+
+uint64_t lock_profiled(pthread_mutex_t* lock, struct LockProfile* profile) {
+  atomic_fetch_add_explicit(&profile->acquires, 1, memory_order_relaxed);
+  // Every acquire reads the clock once to time its hold, only a contended one also times its wait
+  if (pthread_mutex_trylock(lock) == 0) {
+    return metrics_now_ns();
+  }
+
+  uint64_t start = metrics_now_ns();
+  pthread_mutex_lock(lock);
+  uint64_t acquired = metrics_now_ns();
+  atomic_fetch_add_explicit(&profile->contended, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&profile->wait_ns, acquired - start, memory_order_relaxed);
+  return acquired;
+}
+
+void unlock_profiled(pthread_mutex_t* lock, struct LockProfile* profile, uint64_t acquired_ns) {
+  atomic_fetch_add_explicit(&profile->hold_ns, metrics_now_ns() - acquired_ns, memory_order_relaxed);
+  pthread_mutex_unlock(lock);
+}
+
+void lock_profile_add(struct LockProfile* total, const struct LockProfile* profile) {
+  atomic_fetch_add(&total->acquires, atomic_load(&profile->acquires));
+  atomic_fetch_add(&total->contended, atomic_load(&profile->contended));
+  atomic_fetch_add(&total->wait_ns, atomic_load(&profile->wait_ns));
+  atomic_fetch_add(&total->hold_ns, atomic_load(&profile->hold_ns));
+}
+
+int lock_profile_format(struct OutputBuffer* out, const char* label, const struct LockProfile* profile) {
+  return append_format(out, "  %s: %lu acquires, %lu contended, wait %.3f ms, hold %.3f ms\n", label,
+                       atomic_load(&profile->acquires), atomic_load(&profile->contended),
+                       (double)atomic_load(&profile->wait_ns) / 1e6, (double)atomic_load(&profile->hold_ns) / 1e6);
+}
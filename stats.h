@@ -0,0 +1,125 @@
+#ifndef EMS_STATS_H
+#define EMS_STATS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "outbuf.h"
+#include "parser.h"
+
+/// Latencies of the commands run by one thread, in microseconds.
+struct LatencySamples {
+  double* values;
+  size_t count;
+  size_t capacity;
+};
+
+/// Records the latency of one command.
+/// @param samples Samples to add to.
+/// @param us Latency in microseconds.
+/// @return 0 if the latency was recorded successfully, 1 otherwise.
+int latency_record(struct LatencySamples* samples, double us);
+
+/// Appends every sample of another set.
+/// @param samples Samples to add to.
+/// @param other Samples to be added.
+/// @return 0 if the samples were added successfully, 1 otherwise.
+int latency_merge(struct LatencySamples* samples, const struct LatencySamples* other);
+
+/// Computes a percentile with the nearest-rank method.
+/// @note Sorts the samples.
+/// @param samples Samples to look at.
+/// @param pct Percentile, between 0 and 100.
+/// @return The percentile, 0 if there are no samples.
+double latency_percentile(struct LatencySamples* samples, double pct);
+
+/// Frees the memory of a set of samples, leaving it empty.
+/// @param samples Samples to be freed.
+void latency_free(struct LatencySamples* samples);
+
+/// Writes the summary of a run as one line of JSON, in a single write so
+/// that processes appending to the same file do not interleave.
+/// @param fd File descriptor to write to, opened with O_APPEND.
+/// @param job Name of the job, or of the run.
+/// @param threads Number of threads that ran the commands.
+/// @param wall_ms Duration of the run.
+/// @param samples Latency of every command of the run.
+/// @return 0 if the line was written, 1 otherwise.
+int stats_write(int fd, const char* job, int threads, double wall_ms, struct LatencySamples* samples);
+
+/// Time outside of the commands themselves that the metrics keep track of.
+enum MetricsTimer {
+  TIMER_PARSE,   /// Loading job files.
+  TIMER_OUTPUT,  /// Writing SHOW and LIST output to the .out files.
+  NUM_TIMERS
+};
+
+/// Sets up the counters and latency histograms of every command type, in
+/// shared memory so that every process forked afterwards adds to them.
+/// @return 0 if the metrics were set up successfully, 1 otherwise.
+int metrics_init(void);
+
+/// @return Whether metrics_init was called.
+int metrics_enabled(void);
+
+/// @return Monotonic time in nanoseconds.
+uint64_t metrics_now_ns(void);
+
+/// Records a command and how long it took. State accesses made by the
+/// calling thread since its previous command are counted against it.
+/// @param command Type of the command.
+/// @param ns Duration of the command, in nanoseconds.
+void metrics_record_command(enum Command command, uint64_t ns);
+
+/// Records an access to the EMS state by the calling thread.
+/// @param ns Time spent in the simulated access delay, in nanoseconds.
+void metrics_record_state_access(uint64_t ns);
+
+/// Adds time to one of the timers.
+void metrics_add_time(enum MetricsTimer timer, uint64_t ns);
+
+/// Writes every counter and non-empty histogram bucket as one line of JSON.
+/// @param fd File descriptor to write to.
+/// @return 0 if the metrics were written, 1 otherwise.
+int metrics_dump(int fd);
+
+/// Contention of one lock, filled in while lock profiling is on.
+struct LockProfile {
+  atomic_ulong acquires;
+  atomic_ulong contended;  /// Acquires that found the lock taken.
+  atomic_ulong wait_ns;    /// Time spent waiting for the lock.
+  atomic_ulong hold_ns;    /// Time the lock was held.
+};
+
+/// Turns lock profiling on.
+/// @note Must be called before ems_init, locks created earlier are not profiled.
+void lock_profiling_enable(void);
+
+/// @return Whether lock profiling is on.
+int lock_profiling_enabled(void);
+
+/// Locks a mutex, first with a trylock so that contended acquires can be told apart.
+/// @param lock Mutex to lock.
+/// @param profile Profile of the mutex.
+/// @return Time the lock was acquired, to pass to unlock_profiled.
+uint64_t lock_profiled(pthread_mutex_t* lock, struct LockProfile* profile);
+
+/// Unlocks a mutex locked with lock_profiled.
+/// @param lock Mutex to unlock.
+/// @param profile Profile of the mutex.
+/// @param acquired_ns Time returned by lock_profiled.
+void unlock_profiled(pthread_mutex_t* lock, struct LockProfile* profile, uint64_t acquired_ns);
+
+/// Adds the counts of a profile to another.
+void lock_profile_add(struct LockProfile* total, const struct LockProfile* profile);
+
+/// Appends a line describing a profile.
+/// @param out Buffer to append to.
+/// @param label What the lock guards, printed first.
+/// @param profile Profile to describe.
+/// @return 0 if the line was appended, 1 otherwise.
+int lock_profile_format(struct OutputBuffer* out, const char* label, const struct LockProfile* profile);
+
+#endif  // EMS_STATS_H
@@ -0,0 +1,79 @@
+#include "workqueue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int workqueue_init(struct WorkQueue* queue) {
+  if (pthread_mutex_init(&queue->lock, NULL) != 0) return 1;
+
+  queue->items = NULL;
+  queue->head = 0;
+  queue->tail = 0;
+  queue->capacity = 0;
+  return 0;
+}
+
+void workqueue_reset(struct WorkQueue* queue) {
+  queue->head = 0;
+  queue->tail = 0;
+}
+
+int workqueue_push(struct WorkQueue* queue, size_t index, int pinned) {
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->tail == queue->capacity) {
+    size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+    struct WorkItem* items = realloc(queue->items, capacity * sizeof(struct WorkItem));
+    if (items == NULL) {
+      pthread_mutex_unlock(&queue->lock);
+      return 1;
+    }
+    queue->items = items;
+    queue->capacity = capacity;
+  }
+
+  queue->items[queue->tail].index = index;
+  queue->items[queue->tail].pinned = pinned;
+  queue->tail++;
+
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+int workqueue_pop(struct WorkQueue* queue, size_t* index) {
+  int found = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *index = queue->items[queue->head++].index;
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return found;
+}
+
+int workqueue_steal(struct WorkQueue* queue, size_t* index) {
+  int found = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  // Pinned items are rare (WAIT), so the last item is almost always taken
+  // and nothing has to be shifted.
+  for (size_t i = queue->tail; i > queue->head; i--) {
+    if (!queue->items[i - 1].pinned) {
+      *index = queue->items[i - 1].index;
+      memmove(&queue->items[i - 1], &queue->items[i], (queue->tail - i) * sizeof(struct WorkItem));
+      queue->tail--;
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return found;
+}
+
+void workqueue_destroy(struct WorkQueue* queue) {
+  free(queue->items);
+  pthread_mutex_destroy(&queue->lock);
+}
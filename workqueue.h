@@ -0,0 +1,56 @@
+#ifndef EMS_WORKQUEUE_H
+#define EMS_WORKQUEUE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct WorkItem {
+  size_t index;  /// Instruction index in the program.
+  int pinned;    /// Pinned items are never stolen by other threads.
+};
+
+/// Double-ended queue of instructions owned by one worker thread.
+/// The owner takes work from the head, in program order, while idle threads
+/// steal from the tail.
+struct WorkQueue {
+  pthread_mutex_t lock;
+  struct WorkItem* items;
+  size_t head;      /// Index of the next item the owner will take.
+  size_t tail;      /// One past the last item.
+  size_t capacity;
+};
+
+/// Initializes an empty work queue.
+/// @param queue Queue to be initialized.
+/// @return 0 if the queue was initialized successfully, 1 otherwise.
+int workqueue_init(struct WorkQueue* queue);
+
+/// Empties the queue.
+/// @note Must only be called while no other thread can access the queue.
+/// @param queue Queue to be emptied.
+void workqueue_reset(struct WorkQueue* queue);
+
+/// Appends an item to the tail of the queue.
+/// @param queue Queue to be modified.
+/// @param index Instruction index.
+/// @param pinned Whether the item must be executed by the queue owner.
+/// @return 0 if the item was added successfully, 1 otherwise.
+int workqueue_push(struct WorkQueue* queue, size_t index, int pinned);
+
+/// Takes the item at the head of the queue. Used by the owner.
+/// @param queue Queue to take from.
+/// @param index Pointer to the variable to store the instruction index in.
+/// @return 1 if an item was taken, 0 if the queue was empty.
+int workqueue_pop(struct WorkQueue* queue, size_t* index);
+
+/// Takes the last item of the queue that is not pinned. Used by other threads.
+/// @param queue Queue to steal from.
+/// @param index Pointer to the variable to store the instruction index in.
+/// @return 1 if an item was stolen, 0 if there was nothing to steal.
+int workqueue_steal(struct WorkQueue* queue, size_t* index);
+
+/// Destroys a work queue.
+/// @param queue Queue to be destroyed.
+void workqueue_destroy(struct WorkQueue* queue);
+
+#endif  // EMS_WORKQUEUE_H
@@ -0,0 +1,236 @@
+#include "writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "stats.h"
+
+static int produces_output(enum Command command) { return command == CMD_SHOW || command == CMD_LIST_EVENTS; }
+
+static uint64_t lock_writer(struct OrderedWriter* writer) {
+  if (lock_profiling_enabled()) {
+    return lock_profiled(&writer->lock, &writer->lock_profile);
+  }
+  pthread_mutex_lock(&writer->lock);
+  return 0;
+}
+
+static void unlock_writer(struct OrderedWriter* writer, uint64_t acquired) {
+  if (lock_profiling_enabled()) {
+    unlock_profiled(&writer->lock, &writer->lock_profile, acquired);
+  } else {
+    pthread_mutex_unlock(&writer->lock);
+  }
+}
+
+/// Finds the chunk of an instruction.
+/// @return The chunk, NULL if the instruction produces no output.
+static struct OutputChunk* find_chunk(struct OrderedWriter* writer, size_t index, size_t* position) {
+  // Binary search for the chunk of the instruction
+  size_t low = 0, high = writer->count;
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (writer->commands[mid] <= index) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (writer->count == 0 || writer->commands[low] != index) {
+    fprintf(stderr, "Instruction %zu produces no output\n", index);
+    return NULL;
+  }
+  *position = low;
+  return &writer->chunks[low];
+}
+
+/// Moves the contents of a buffer to the temporary file of its chunk.
+/// @return 0 if the buffer was emptied, 1 if no temporary file could be made
+/// and the buffer still holds its contents, -1 if writing to the file failed.
+static int spill(struct OutputChunk* chunk, struct OutputBuffer* buffer) {
+  if (chunk->spill == NULL && (chunk->spill = tmpfile()) == NULL) {
+    return 1;
+  }
+  size_t len = buffer->len;
+  buffer->len = 0;
+  return fwrite(buffer->data, 1, len, chunk->spill) == len ? 0 : -1;
+}
+
+/// Writes out and closes the temporary file of a chunk.
+/// @return 0 if it was written, 1 on an error.
+static int write_spill(struct OutputChunk* chunk, int fd) {
+  char block[64 * 1024];
+  int result = fflush(chunk->spill) != 0 || fseek(chunk->spill, 0, SEEK_SET) != 0;
+
+  size_t len;
+  while (result == 0 && (len = fread(block, 1, sizeof(block), chunk->spill)) > 0) {
+    result = write_all(fd, block, len) != 0;
+  }
+  if (result == 0 && ferror(chunk->spill)) {
+    result = 1;
+  }
+  fclose(chunk->spill);
+  chunk->spill = NULL;
+  return result;
+}
+
+static void* write_chunks(void* arg) {
+  struct OrderedWriter* writer = (struct OrderedWriter*)arg;
+  int result = 0;
+
+  pthread_mutex_lock(&writer->lock);
+  while (writer->next < writer->count) {
+    struct OutputChunk* chunk = &writer->chunks[writer->next];
+    while (!chunk->ready) {
+      pthread_cond_wait(&writer->chunk_ready, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    // After a write error the remaining chunks are still taken and freed,
+    // just not written.
+    uint64_t start = metrics_enabled() ? metrics_now_ns() : 0;
+    size_t held = chunk->buffer.len;
+    if (chunk->spill != NULL && write_spill(chunk, writer->fd) != 0) {
+      result = 1;
+    }
+    if (result == 0 && outbuf_flush(&chunk->buffer, writer->fd) != 0) {
+      result = 1;
+    }
+    if (metrics_enabled()) metrics_add_time(TIMER_OUTPUT, metrics_now_ns() - start);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->held_bytes -= held;
+    // Buffers grown past what a flushed render needs are not worth keeping
+    if (writer->num_spares < WRITER_SPARE_BUFFERS && chunk->buffer.capacity > 0 &&
+        chunk->buffer.capacity <= 2 * RENDER_FLUSH_BYTES) {
+      chunk->buffer.len = 0;
+      writer->spares[writer->num_spares++] = chunk->buffer;
+      chunk->buffer = (struct OutputBuffer){NULL, 0, 0};
+    } else {
+      outbuf_free(&chunk->buffer);
+    }
+    writer->next++;
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  return result ? (void*)writer : NULL;
+}
+
+int writer_start(struct OrderedWriter* writer, const struct Program* program, int fd) {
+  writer->fd = fd;
+  writer->count = 0;
+  writer->next = 0;
+  writer->held_bytes = 0;
+  writer->num_spares = 0;
+  memset(&writer->lock_profile, 0, sizeof(writer->lock_profile));
+
+  for (size_t i = 0; i < program->count; i++) {
+    if (produces_output(program->instructions[i].command)) writer->count++;
+  }
+
+  writer->commands = malloc((writer->count ? writer->count : 1) * sizeof(size_t));
+  writer->chunks = calloc(writer->count ? writer->count : 1, sizeof(struct OutputChunk));
+  if (writer->commands == NULL || writer->chunks == NULL) {
+    free(writer->commands);
+    free(writer->chunks);
+    return 1;
+  }
+
+  size_t chunk = 0;
+  for (size_t i = 0; i < program->count; i++) {
+    if (produces_output(program->instructions[i].command)) writer->commands[chunk++] = i;
+  }
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->chunk_ready, NULL);
+  if (pthread_create(&writer->thread, NULL, write_chunks, writer) != 0) {
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->chunk_ready);
+    free(writer->commands);
+    free(writer->chunks);
+    return 1;
+  }
+  return 0;
+}
+
+int writer_flush_part(void* part, struct OutputBuffer* buffer) {
+  struct OrderedWriter* writer = ((struct WriterPart*)part)->writer;
+  size_t position;
+  struct OutputChunk* chunk = find_chunk(writer, ((struct WriterPart*)part)->index, &position);
+  if (chunk == NULL) {
+    return 1;
+  }
+
+  uint64_t acquired = lock_writer(writer);
+  int turn = position == writer->next;
+  unlock_writer(writer, acquired);
+
+  if (!turn) {
+    return spill(chunk, buffer) < 0;
+  }
+
+  // Every earlier chunk is written and the writer thread waits for this
+  // one, which is not ready yet, so the output can go out from here
+  if (chunk->spill != NULL && write_spill(chunk, writer->fd) != 0) {
+    return 1;
+  }
+  return outbuf_flush(buffer, writer->fd) != 0;
+}
+
+void writer_submit(struct OrderedWriter* writer, size_t index, struct OutputBuffer* buffer) {
+  size_t position;
+  struct OutputChunk* chunk = find_chunk(writer, index, &position);
+  if (chunk == NULL) {
+    return;
+  }
+
+  uint64_t acquired = lock_writer(writer);
+  int hold = position == writer->next || writer->held_bytes + buffer->len <= WRITER_HELD_BYTES;
+  unlock_writer(writer, acquired);
+
+  // Output that waits behind too much held memory goes to a temporary file
+  // and the buffer stays with the worker, still to be reused
+  int spilled = 0;
+  if (!hold) {
+    int result = spill(chunk, buffer);
+    if (result < 0) {
+      fprintf(stderr, "Failed to put output aside\n");
+    }
+    spilled = result != 1;
+  }
+
+  acquired = lock_writer(writer);
+  if (spilled) {
+    chunk->buffer = (struct OutputBuffer){NULL, 0, 0};
+  } else {
+    chunk->buffer = *buffer;
+    writer->held_bytes += buffer->len;
+    if (writer->num_spares > 0) {
+      *buffer = writer->spares[--writer->num_spares];
+    } else {
+      *buffer = (struct OutputBuffer){NULL, 0, 0};
+    }
+  }
+  chunk->ready = 1;
+  if (position == writer->next) {
+    pthread_cond_signal(&writer->chunk_ready);
+  }
+  unlock_writer(writer, acquired);
+}
+
+int writer_finish(struct OrderedWriter* writer) {
+  void* failed;
+  pthread_join(writer->thread, &failed);
+
+  for (size_t i = 0; i < writer->num_spares; i++) {
+    outbuf_free(&writer->spares[i]);
+  }
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->chunk_ready);
+  free(writer->commands);
+  free(writer->chunks);
+  return failed != NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef EMS_WRITER_H
+#define EMS_WRITER_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "outbuf.h"
+#include "program.h"
+#include "stats.h"
+
+/// Number of written buffers kept for the workers to reuse.
+#define WRITER_SPARE_BUFFERS 16
+
+/// Output of one command, waiting for its turn to be written.
+struct OutputChunk {
+  struct OutputBuffer buffer;
+  FILE* spill;  /// Output put aside in a temporary file until its turn, written before buffer. NULL if none.
+  int ready;
+};
+
+/// Writes the output of a job's commands in program order, from a thread of
+/// its own, whatever order the commands finish in.
+struct OrderedWriter {
+  int fd;
+  size_t* commands;             /// Indexes of the instructions that produce output, ascending.
+  struct OutputChunk* chunks;   /// Output of each of those instructions.
+  size_t count;                 /// Number of instructions that produce output.
+  size_t next;                  /// Next chunk to be written.
+  size_t held_bytes;            /// Bytes of the ready chunks still in memory, at most WRITER_HELD_BYTES
+                                /// unless a temporary file could not be made.
+
+  struct OutputBuffer spares[WRITER_SPARE_BUFFERS];  /// Written buffers, handed back by writer_submit.
+  size_t num_spares;
+
+  pthread_mutex_t lock;
+  pthread_cond_t chunk_ready;
+  pthread_t thread;
+
+  struct LockProfile lock_profile;  /// Contention of lock in writer_submit, with lock profiling on.
+};
+
+/// Part of the output of an instruction, for an OutputSink that hands it to the writer.
+struct WriterPart {
+  struct OrderedWriter* writer;
+  size_t index;  /// Index of a SHOW or LIST instruction.
+};
+
+/// Starts the writer thread for a program.
+/// @param writer Writer to be initialized.
+/// @param program Program whose SHOW and LIST output will be written.
+/// @param fd File descriptor to write to.
+/// @return 0 if the writer was started successfully, 1 otherwise.
+int writer_start(struct OrderedWriter* writer, const struct Program* program, int fd);
+
+/// Flush function of an OutputSink whose context is a struct WriterPart.
+/// Hands over the output of an instruction formatted so far: it is written
+/// right away if every earlier output was, or put aside in a temporary file
+/// until then.
+/// @note The buffer keeps its memory. If no temporary file can be made, the
+/// output stays in the buffer and is handed over with the rest of it.
+/// @param part Instruction the output belongs to.
+/// @param buffer Output formatted so far.
+/// @return 0 if the output was handed over, 1 on a write error.
+int writer_flush_part(void* part, struct OutputBuffer* buffer);
+
+/// Hands the output of an instruction to the writer.
+/// @note Takes ownership of the buffer's memory and leaves the buffer with
+/// a written one to reuse, if any, or empty.
+/// @param writer Writer of the program the instruction belongs to.
+/// @param index Index of a SHOW or LIST instruction.
+/// @param buffer Output of the instruction, possibly empty.
+void writer_submit(struct OrderedWriter* writer, size_t index, struct OutputBuffer* buffer);
+
+/// Waits for all the output to be written and frees the writer.
+/// @note Every SHOW and LIST must have been submitted.
+/// @param writer Writer to be stopped.
+/// @return 0 if all the output was written, 1 otherwise.
+int writer_finish(struct OrderedWriter* writer);
+
+#endif  // EMS_WRITER_H